@@ -5,6 +5,8 @@ gcc -std=gnu99 -o otp_dec otp_dec.c
 gcc -std=gnu99 -o otp_dec_d otp_dec_d.c
 gcc -std=gnu99 -o otp_enc otp_enc.c
 gcc -std=gnu99 -o otp_enc_d otp_enc_d.c
-chmod u+x keygen otp_dec otp_dec_d otp_enc otp_enc_d
+gcc -std=gnu99 -c -o otp_client.o otp_client.c && ar rcs libotp_client.a otp_client.o
+gcc -std=gnu99 -o otp_client_example otp_client_example.c libotp_client.a
+chmod u+x keygen otp_dec otp_dec_d otp_enc otp_enc_d otp_client_example
 
 exit 0
\ No newline at end of file
@@ -0,0 +1,807 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "otp_client.h"
+
+/* Only the otp functions declared in otp_client.h are visible outside this file, so the library can be linked into
+ * programs that have helpers of the same names. Every request is a stream request, so a connection can carry any
+ * number of them one after another. Up to PIPELINE_DEPTH of them are sent ahead on a connection without waiting for
+ * the ones before them to come back. */
+#define DEFAULT_CONNECTIONS_PER_ENDPOINT 2
+#define PIPELINE_DEPTH 32
+#define STREAM_CHUNK_SIZE 65536
+#define RETRY_LIMIT 4
+#define BUSY_RETRY_LIMIT 40
+#define BUSY_BACKOFF_MIN_MS 50
+#define BUSY_BACKOFF_MAX_MS 1000
+#define RECONNECT_DELAY_MS 100
+
+/* A connection that hasn't been made and answered its handshake within CONNECT_TIMEOUT_MS is given up on, so its
+ * requests go to another endpoint. One that's had nothing in flight for IDLE_TIMEOUT_MS is closed, since it holds one
+ * of the daemon's workers for as long as it's open. */
+#define CONNECT_TIMEOUT_MS 2000
+#define IDLE_TIMEOUT_MS 1000
+
+#define CONNECTION_CLOSED 0
+#define CONNECTION_CONNECTING 1
+#define CONNECTION_HANDSHAKE 2
+#define CONNECTION_READY 3
+
+#define REQUEUE_WAITING 0
+#define REQUEUE_BUSY 1
+#define REQUEUE_FAILED 2
+
+struct otpEndpoint {
+  char host[256];
+  int portNumber;
+  struct sockaddr_in address;
+};
+
+/* A submitted request. sent counts the bytes of its header and stream that have gone out on its current connection,
+ * and received the bytes of output that have come back after its status line. */
+struct otpRequest {
+  long id;
+  const char* message;
+  const char* key;
+  size_t length;
+  otpCallback callback;
+  void* context;
+  char header[64];
+  size_t headerLength;
+  size_t sent;
+  size_t received;
+  char* output;
+  int statusDone;
+  int status;
+  char error[128];
+  int attempts;
+  int busyRetries;
+  long long notBefore;
+  struct otpRequest* next;
+};
+
+/* A connection to one endpoint. Its requests are kept oldest first, since the daemon answers them in the order they
+ * were sent, and sending points at the first one that hasn't been completely sent. closeAt is when the connection is
+ * given up on if it's still being opened, or closed if it's still idle. */
+struct otpConnection {
+  int socketFD;
+  int state;
+  int endpointIndex;
+  char reply[128];
+  size_t replyLength;
+  struct otpRequest* head;
+  struct otpRequest* tail;
+  struct otpRequest* sending;
+  int inFlight;
+  long long retryAt;
+  long long closeAt;
+};
+
+struct otpClient {
+  const char* handshake;
+  const char* validator;
+  struct otpEndpoint* endpoints;
+  int endpointCount;
+  struct otpConnection* connections;
+  int connectionCount;
+  struct pollfd* pollSet;
+  struct otpRequest* queueHead;
+  struct otpRequest* queueTail;
+  struct otpRequest* doneHead;
+  struct otpRequest* doneTail;
+  struct otpRequest* finishedHead;
+  struct otpRequest* finishedTail;
+  size_t pending;
+  long nextId;
+};
+
+static int parseClientEndpoints(const char[], struct otpEndpoint**);
+static void assignRequests(struct otpClient*);
+static void closeExpiredConnections(struct otpClient*);
+static int openConnection(struct otpClient*, struct otpConnection*);
+static void finishConnecting(struct otpClient*, struct otpConnection*);
+static void receiveHandshake(struct otpClient*, struct otpConnection*);
+static void sendRequests(struct otpClient*, struct otpConnection*);
+static void receiveResponses(struct otpClient*, struct otpConnection*);
+static int handleStatusLine(struct otpClient*, struct otpConnection*);
+static void closeConnection(struct otpClient*, struct otpConnection*, int);
+static void requeueRequest(struct otpClient*, struct otpRequest*, int);
+static void finishRequest(struct otpClient*, struct otpRequest*, int, const char[]);
+static int deliverRequests(struct otpClient*);
+static void appendRequest(struct otpRequest**, struct otpRequest**, struct otpRequest*);
+static void freeRequests(struct otpRequest*);
+static long long currentMilliseconds(void);
+static int isValidString(const char[], size_t);
+
+struct otpClient* otpCreateClient(const char endpoints[], int operation, int connectionsPerEndpoint) {
+  struct otpClient* client = malloc(sizeof(struct otpClient));
+
+  if (client == NULL)
+    return(NULL);
+  memset(client, '\0', sizeof(struct otpClient));
+  // Each daemon only answers the handshake that belongs to it, the same one otp_enc and otp_dec send
+  client->handshake = operation == OTP_DECRYPT ? "<<||" : ">>||";
+  client->validator = operation == OTP_DECRYPT ? "<<" : ">>";
+
+  client->endpointCount = parseClientEndpoints(endpoints, &client->endpoints);
+  if (client->endpointCount < 1) {
+    free(client->endpoints);
+    free(client);
+    return(NULL);
+  }
+
+  if (connectionsPerEndpoint < 1)
+    connectionsPerEndpoint = DEFAULT_CONNECTIONS_PER_ENDPOINT;
+  client->connectionCount = client->endpointCount * connectionsPerEndpoint;
+  client->connections = malloc(client->connectionCount * sizeof(struct otpConnection));
+  client->pollSet = malloc(client->connectionCount * sizeof(struct pollfd));
+  if (client->connections == NULL || client->pollSet == NULL) {
+    free(client->connections);
+    free(client->pollSet);
+    free(client->endpoints);
+    free(client);
+    return(NULL);
+  }
+  memset(client->connections, '\0', client->connectionCount * sizeof(struct otpConnection));
+  for (int i = 0; i < client->connectionCount; i++) {
+    client->connections[i].socketFD = -1;
+    client->connections[i].state = CONNECTION_CLOSED;
+    // Spread each endpoint's connections through the list so new work is shared out between endpoints
+    client->connections[i].endpointIndex = i % client->endpointCount;
+  }
+
+  return(client);
+}
+
+long otpSubmit(struct otpClient* client, const char message[], const char key[], size_t length, otpCallback callback, void* context) {
+  struct otpRequest* request = NULL;
+
+  // Turn away anything the daemon would encrypt into garbage now, instead of after it's been sent
+  if (!isValidString(message, length) || !isValidString(key, length))
+    return(-1);
+
+  request = malloc(sizeof(struct otpRequest));
+  if (request == NULL)
+    return(-1);
+  memset(request, '\0', sizeof(struct otpRequest));
+  request->id = client->nextId++;
+  request->message = message;
+  request->key = key;
+  request->length = length;
+  request->callback = callback;
+  request->context = context;
+  request->headerLength = snprintf(request->header, sizeof(request->header), "#S %zu %d\n", length, STREAM_CHUNK_SIZE);
+
+  appendRequest(&client->queueHead, &client->queueTail, request);
+  client->pending++;
+
+  return(request->id);
+}
+
+int otpPoll(struct otpClient* client, int timeout) {
+  int watchedCount = 0, finished = 0, result = -5;
+  long long now = currentMilliseconds(), deadline = timeout >= 0 ? now + timeout : -1, wakeAt = -1;
+  struct otpConnection* connection = NULL;
+  struct otpRequest* request = NULL;
+
+  do {
+    closeExpiredConnections(client);
+    assignRequests(client);
+
+    // Watch every open connection for whatever it's waiting on
+    watchedCount = 0;
+    for (int i = 0; i < client->connectionCount; i++) {
+      connection = &client->connections[i];
+      client->pollSet[i].fd = connection->socketFD;
+      client->pollSet[i].events = 0;
+      client->pollSet[i].revents = 0;
+      if (connection->state == CONNECTION_CLOSED)
+        continue;
+
+      if (connection->state == CONNECTION_CONNECTING)
+        client->pollSet[i].events = POLLOUT;
+      else if (connection->state == CONNECTION_READY && connection->sending != NULL)
+        client->pollSet[i].events = POLLIN | POLLOUT;
+      else
+        client->pollSet[i].events = POLLIN;
+      watchedCount++;
+    }
+
+    // Requests waiting out a busy daemon, or for a connection to be reopened, have to wake the poll up
+    now = currentMilliseconds();
+    wakeAt = deadline;
+    for (request = client->queueHead; request != NULL; request = request->next) {
+      if (request->notBefore > now && (wakeAt < 0 || request->notBefore < wakeAt))
+        wakeAt = request->notBefore;
+    }
+    for (int i = 0; client->queueHead != NULL && i < client->connectionCount; i++) {
+      connection = &client->connections[i];
+      if (connection->state == CONNECTION_CLOSED && connection->retryAt > now && (wakeAt < 0 || connection->retryAt < wakeAt))
+        wakeAt = connection->retryAt;
+    }
+    for (int i = 0; i < client->connectionCount; i++) {
+      connection = &client->connections[i];
+      if (connection->closeAt > 0 && (wakeAt < 0 || connection->closeAt < wakeAt))
+        wakeAt = connection->closeAt;
+    }
+    // Nothing is left to wait for, though closing connections that took too long may have finished some requests
+    if (watchedCount == 0 && wakeAt < 0) {
+      finished += deliverRequests(client);
+      break;
+    }
+    if (client->pending == 0)
+      wakeAt = now; // Only look for closed connections, rather than waiting for idle ones to time out
+
+    result = poll(client->pollSet, client->connectionCount, wakeAt < 0 ? -1 : (wakeAt > now ? (int) (wakeAt - now) : 0));
+    if (result < 0 && errno != EINTR)
+      break;
+
+    for (int i = 0; result > 0 && i < client->connectionCount; i++) {
+      connection = &client->connections[i];
+      if (client->pollSet[i].revents == 0 || connection->state == CONNECTION_CLOSED)
+        continue;
+
+      if (connection->state == CONNECTION_CONNECTING) {
+        finishConnecting(client, connection);
+      } else if (connection->state == CONNECTION_HANDSHAKE) {
+        receiveHandshake(client, connection);
+      } else {
+        if (client->pollSet[i].revents & POLLOUT)
+          sendRequests(client, connection);
+        if (connection->state == CONNECTION_READY && (client->pollSet[i].revents & (POLLIN | POLLHUP | POLLERR)))
+          receiveResponses(client, connection);
+      }
+    }
+
+    finished += deliverRequests(client);
+  } while (finished == 0 && client->pending > 0 && (deadline < 0 || currentMilliseconds() < deadline));
+
+  return(finished);
+}
+
+int otpNextResult(struct otpClient* client, struct otpResult* result) {
+  struct otpRequest* request = client->doneHead;
+
+  if (request == NULL)
+    return(0);
+
+  client->doneHead = request->next;
+  if (client->doneHead == NULL)
+    client->doneTail = NULL;
+
+  result->id = request->id;
+  result->status = request->status;
+  result->output = request->output;
+  result->length = request->length;
+  result->context = request->context;
+  strcpy(result->error, request->error);
+  free(request);
+
+  return(1);
+}
+
+size_t otpPending(const struct otpClient* client) {
+  return(client->pending);
+}
+
+void otpDestroyClient(struct otpClient* client) {
+  for (int i = 0; i < client->connectionCount; i++) {
+    if (client->connections[i].socketFD >= 0)
+      close(client->connections[i].socketFD);
+    freeRequests(client->connections[i].head);
+  }
+  freeRequests(client->queueHead);
+  freeRequests(client->finishedHead);
+  freeRequests(client->doneHead);
+
+  free(client->connections);
+  free(client->pollSet);
+  free(client->endpoints);
+  free(client);
+}
+
+/* Takes a comma separated list of endpoints, each either a port number or a host and port number separated by a
+ * colon, then stores them in a newly allocated array with their host names already resolved, so nothing blocks on
+ * name lookups later. Returns the number of endpoints, or -1 if any were invalid or couldn't be resolved. */
+static int parseClientEndpoints(const char list[], struct otpEndpoint** endpoints) {
+  int endpointCount = 1, index = 0;
+  const char* start = list;
+  struct hostent* serverHostInfo = NULL;
+
+  for (size_t i = 0; i < strlen(list); i++) {
+    if (list[i] == ',')
+      endpointCount++;
+  }
+
+  *endpoints = malloc(endpointCount * sizeof(struct otpEndpoint));
+  if (*endpoints == NULL)
+    return(-1);
+  memset(*endpoints, '\0', endpointCount * sizeof(struct otpEndpoint));
+
+  while (index < endpointCount) {
+    struct otpEndpoint* target = &(*endpoints)[index];
+    size_t length = strcspn(start, ",");
+    const char* colon = memchr(start, ':', length);
+    const char* port = start;
+
+    // Default to localhost when only a port number was provided, as the clients always have
+    if (colon == NULL) {
+      strcpy(target->host, "localhost");
+    } else {
+      if (colon == start || colon - start >= sizeof(target->host))
+        return(-1);
+      memcpy(target->host, start, colon - start);
+      port = colon + 1;
+    }
+
+    target->portNumber = atoi(port);
+    if (target->portNumber <= 0)
+      return(-1);
+
+    serverHostInfo = gethostbyname(target->host);
+    if (serverHostInfo == NULL)
+      return(-1);
+    target->address.sin_family = AF_INET;
+    target->address.sin_port = htons(target->portNumber);
+    memcpy((char*) &target->address.sin_addr.s_addr, (char*) serverHostInfo->h_addr, serverHostInfo->h_length);
+
+    start += length + 1;
+    index++;
+  }
+
+  return(endpointCount);
+}
+
+/* Takes a client, then moves queued requests that are ready to go onto the connection with the fewest requests in
+ * flight, opening more connections when every open one is already full. Requests stay queued if every connection is
+ * full or waiting to be reopened. */
+static void assignRequests(struct otpClient* client) {
+  struct otpRequest* request = client->queueHead;
+  struct otpRequest* previous = NULL;
+  struct otpConnection* chosen = NULL;
+  long long now = currentMilliseconds();
+
+  while (request != NULL) {
+    struct otpRequest* next = request->next;
+
+    if (request->notBefore > now) {
+      previous = request;
+      request = next;
+      continue;
+    }
+
+    chosen = NULL;
+    for (int i = 0; i < client->connectionCount; i++) {
+      struct otpConnection* connection = &client->connections[i];
+      if (connection->state != CONNECTION_CLOSED && connection->inFlight < PIPELINE_DEPTH &&
+          (chosen == NULL || connection->inFlight < chosen->inFlight))
+        chosen = connection;
+    }
+
+    // Open another connection instead of queueing behind requests that are already in flight
+    if (chosen == NULL || chosen->inFlight > 0) {
+      for (int i = 0; i < client->connectionCount; i++) {
+        struct otpConnection* connection = &client->connections[i];
+        if (connection->state == CONNECTION_CLOSED && connection->retryAt <= now && openConnection(client, connection) == 0) {
+          chosen = connection;
+          break;
+        }
+      }
+    }
+
+    if (chosen == NULL) {
+      previous = request;
+      request = next;
+      continue;
+    }
+
+    // Take the request off the queue and send it after whatever the connection already has
+    if (previous == NULL)
+      client->queueHead = next;
+    else
+      previous->next = next;
+    if (client->queueTail == request)
+      client->queueTail = previous;
+
+    request->next = NULL;
+    appendRequest(&chosen->head, &chosen->tail, request);
+    if (chosen->sending == NULL)
+      chosen->sending = request;
+    chosen->inFlight++;
+    if (chosen->state == CONNECTION_READY)
+      chosen->closeAt = 0;
+    request = next;
+  }
+}
+
+/* Takes a client, then closes every connection that's taken too long to open, which counts against its requests'
+ * attempts, and every connection that's been idle for too long. */
+static void closeExpiredConnections(struct otpClient* client) {
+  long long now = currentMilliseconds();
+
+  for (int i = 0; i < client->connectionCount; i++) {
+    struct otpConnection* connection = &client->connections[i];
+    if (connection->closeAt > 0 && connection->closeAt <= now)
+      closeConnection(client, connection, connection->state != CONNECTION_READY);
+  }
+}
+
+/* Takes a client and one of its closed connections, then starts connecting it to its endpoint without waiting for
+ * the connection to be made. Returns 0 if the connection was started, or -1 if it couldn't be. */
+static int openConnection(struct otpClient* client, struct otpConnection* connection) {
+  const struct otpEndpoint* target = &client->endpoints[connection->endpointIndex];
+  int noDelay = 1;
+
+  connection->socketFD = socket(AF_INET, SOCK_STREAM, 0);
+  if (connection->socketFD < 0) {
+    connection->retryAt = currentMilliseconds() + RECONNECT_DELAY_MS;
+    return(-1);
+  }
+  fcntl(connection->socketFD, F_SETFL, O_NONBLOCK);
+  // Pipelined requests are sent as soon as they're ready instead of waiting to be coalesced
+  setsockopt(connection->socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+  connection->replyLength = 0;
+  connection->inFlight = 0;
+  connection->head = connection->tail = connection->sending = NULL;
+  if (connect(connection->socketFD, (const struct sockaddr*) &target->address, sizeof(target->address)) < 0 &&
+      errno != EINPROGRESS) {
+    close(connection->socketFD);
+    connection->socketFD = -1;
+    connection->retryAt = currentMilliseconds() + RECONNECT_DELAY_MS;
+    return(-1);
+  }
+  connection->state = CONNECTION_CONNECTING;
+  connection->closeAt = currentMilliseconds() + CONNECT_TIMEOUT_MS;
+
+  return(0);
+}
+
+/* Takes a client and a connection whose connect has finished, then sends the handshake if it succeeded. The
+ * handshake is only a few bytes on an empty socket, so it's always sent in one go. */
+static void finishConnecting(struct otpClient* client, struct otpConnection* connection) {
+  int socketError = 0;
+  socklen_t errorLength = sizeof(socketError);
+
+  if (getsockopt(connection->socketFD, SOL_SOCKET, SO_ERROR, &socketError, &errorLength) < 0 || socketError != 0 ||
+      send(connection->socketFD, client->handshake, strlen(client->handshake), 0) != (ssize_t) strlen(client->handshake)) {
+    closeConnection(client, connection, 1);
+    return;
+  }
+  connection->state = CONNECTION_HANDSHAKE;
+}
+
+/* Takes a client and a connection waiting for the daemon to answer its handshake, then reads whatever has arrived
+ * until the "||" that ends it, the same way receiveStringFromSocket does. The daemon only starts reading requests
+ * once it has answered, so none are sent before then. */
+static void receiveHandshake(struct otpClient* client, struct otpConnection* connection) {
+  ssize_t charsRead = recv(connection->socketFD, connection->reply + connection->replyLength,
+                           sizeof(connection->reply) - 1 - connection->replyLength, 0);
+  char* terminalLocation = NULL;
+
+  if (charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (charsRead <= 0) {
+    closeConnection(client, connection, 1);
+    return;
+  }
+
+  connection->replyLength += charsRead;
+  connection->reply[connection->replyLength] = '\0';
+  terminalLocation = strstr(connection->reply, "||");
+  if (terminalLocation == NULL) {
+    if (connection->replyLength == sizeof(connection->reply) - 1)
+      closeConnection(client, connection, 1);
+    return;
+  }
+
+  *terminalLocation = '\0';
+  if (strcmp(connection->reply, client->validator) != 0) {
+    // A different program answered, so try the requests somewhere else
+    closeConnection(client, connection, 1);
+    return;
+  }
+  connection->replyLength = 0;
+  connection->state = CONNECTION_READY;
+  connection->closeAt = connection->head == NULL ? currentMilliseconds() + IDLE_TIMEOUT_MS : 0;
+}
+
+/* Takes a client and a ready connection, then sends as much of its unsent requests as the socket will take without
+ * blocking. Each request is its header line followed by the message and key interleaved, a chunk of each at a time,
+ * exactly as streamStripe sends them in otp_enc. */
+static void sendRequests(struct otpClient* client, struct otpConnection* connection) {
+  ssize_t charsMoved = -5;
+
+  while (connection->sending != NULL) {
+    struct otpRequest* request = connection->sending;
+    size_t streamLength = 2 * request->length;
+
+    if (request->sent < request->headerLength) {
+      charsMoved = send(connection->socketFD, request->header + request->sent, request->headerLength - request->sent, 0);
+    } else if (request->sent - request->headerLength < streamLength) {
+      // Work out which chunk, and whether its message or key half, the next byte in the stream comes from
+      size_t position = request->sent - request->headerLength;
+      size_t chunkStart = position / (2 * STREAM_CHUNK_SIZE) * STREAM_CHUNK_SIZE;
+      size_t chunkLength = request->length - chunkStart < STREAM_CHUNK_SIZE ? request->length - chunkStart : STREAM_CHUNK_SIZE;
+      size_t withinChunk = position - 2 * chunkStart;
+
+      if (withinChunk < chunkLength)
+        charsMoved = send(connection->socketFD, request->message + chunkStart + withinChunk, chunkLength - withinChunk, 0);
+      else
+        charsMoved = send(connection->socketFD, request->key + chunkStart + withinChunk - chunkLength,
+                          2 * chunkLength - withinChunk, 0);
+    } else {
+      connection->sending = request->next;
+      continue;
+    }
+
+    if (charsMoved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (charsMoved <= 0) {
+      closeConnection(client, connection, 1);
+      return;
+    }
+    request->sent += charsMoved;
+  }
+}
+
+/* Takes a client and a ready connection, then reads whatever responses have arrived without blocking. Responses come
+ * back in the order the requests were sent, so everything read belongs to the oldest request still in flight: first
+ * its status line, read a character at a time so none of the output is read with it, then its output. */
+static void receiveResponses(struct otpClient* client, struct otpConnection* connection) {
+  ssize_t charsMoved = -5;
+
+  while (connection->state == CONNECTION_READY) {
+    struct otpRequest* request = connection->head;
+
+    // Anything arriving when no request is waiting means the daemon has gone away or closed the idle connection
+    if (request == NULL) {
+      closeConnection(client, connection, 0);
+      return;
+    }
+
+    if (!request->statusDone)
+      charsMoved = recv(connection->socketFD, connection->reply + connection->replyLength, 1, 0);
+    else
+      charsMoved = recv(connection->socketFD, request->output + request->received, request->length - request->received, 0);
+
+    if (charsMoved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (charsMoved <= 0) {
+      closeConnection(client, connection, 1);
+      return;
+    }
+
+    if (!request->statusDone) {
+      connection->replyLength += charsMoved;
+      if (connection->reply[connection->replyLength - 1] != '\n' && connection->replyLength < sizeof(connection->reply) - 1)
+        continue;
+      if (handleStatusLine(client, connection) < 0)
+        return;
+    } else {
+      request->received += charsMoved;
+    }
+
+    if (request->statusDone && request->received == request->length) {
+      connection->head = request->next;
+      if (connection->head == NULL)
+        connection->tail = NULL;
+      connection->inFlight--;
+      request->output[request->length] = '\0';
+      finishRequest(client, request, OTP_OK, NULL);
+
+      // Keep the connection for the next requests, for a while, instead of reading on and finding nothing there
+      if (connection->head == NULL) {
+        connection->closeAt = currentMilliseconds() + IDLE_TIMEOUT_MS;
+        return;
+      }
+    }
+  }
+}
+
+/* Takes a client and a connection that has just received the status line for its oldest request. An accepted request
+ * gets somewhere to put its output. The daemon closes the connection after a request it doesn't accept, so a request
+ * it was too busy for is queued again to be tried after a delay, and one it turned down is finished with the reason.
+ * An accepted request with no room for its output fails, and the connection is closed since the output is still on
+ * its way. Returns 0 if the request was accepted, or -1 if the connection has been closed. */
+static int handleStatusLine(struct otpClient* client, struct otpConnection* connection) {
+  struct otpRequest* request = connection->head;
+  char* reason = connection->reply + 1;
+
+  connection->reply[connection->replyLength] = '\0';
+  connection->replyLength = 0;
+
+  if (connection->reply[0] == '+') {
+    request->output = malloc(request->length + 1);
+    if (request->output != NULL) {
+      request->statusDone = 1;
+      return(0);
+    }
+  }
+
+  // Take the request off the connection so only the ones that were never looked at are tried again
+  connection->head = request->next;
+  if (connection->head == NULL)
+    connection->tail = NULL;
+  if (connection->sending == request)
+    connection->sending = request->next;
+  connection->inFlight--;
+
+  if (connection->reply[0] == '+') {
+    finishRequest(client, request, OTP_FAILED, "There wasn't enough memory for the output.");
+  } else if (connection->reply[0] == '~') {
+    requeueRequest(client, request, REQUEUE_BUSY);
+  } else {
+    reason[strcspn(reason, "\n")] = '\0';
+    finishRequest(client, request, OTP_REJECTED, reason);
+  }
+
+  closeConnection(client, connection, 0);
+  return(-1);
+}
+
+/* Takes a client, one of its connections and whether the connection failed, then closes it and queues every request
+ * that was on it to be sent again. The requests are only transformed, never stored, so resending them is always
+ * safe. A failed connection counts against its requests' attempts, and neither it nor any other closed connection to
+ * the same endpoint is reopened straight away, so its requests go to another endpoint if there is one. */
+static void closeConnection(struct otpClient* client, struct otpConnection* connection, int failed) {
+  struct otpRequest* request = connection->head;
+  struct otpRequest* next = NULL;
+
+  if (connection->socketFD >= 0)
+    close(connection->socketFD);
+  connection->socketFD = -1;
+  connection->state = CONNECTION_CLOSED;
+  connection->replyLength = 0;
+  connection->closeAt = 0;
+  connection->retryAt = failed ? currentMilliseconds() + RECONNECT_DELAY_MS : 0;
+  for (int i = 0; failed && i < client->connectionCount; i++) {
+    if (client->connections[i].endpointIndex == connection->endpointIndex &&
+        client->connections[i].state == CONNECTION_CLOSED)
+      client->connections[i].retryAt = connection->retryAt;
+  }
+
+  while (request != NULL) {
+    next = request->next;
+    requeueRequest(client, request, failed ? REQUEUE_FAILED : REQUEUE_WAITING);
+    request = next;
+  }
+  connection->head = connection->tail = connection->sending = NULL;
+  connection->inFlight = 0;
+}
+
+/* Takes a client, a request taken off its connection and why, then resets the request and queues it again. A
+ * request the daemon was too busy for waits a growing delay first, one whose connection failed counts it against its
+ * attempts, and one that was only waiting behind another request is sent again as it was. A request that has run out
+ * of attempts is finished as failed instead. */
+static void requeueRequest(struct otpClient* client, struct otpRequest* request, int reason) {
+  long long backoff = BUSY_BACKOFF_MIN_MS;
+
+  free(request->output);
+  request->output = NULL;
+  request->sent = 0;
+  request->received = 0;
+  request->statusDone = 0;
+  request->notBefore = 0;
+
+  if (reason == REQUEUE_FAILED && ++request->attempts >= RETRY_LIMIT) {
+    finishRequest(client, request, OTP_FAILED, "The request could not be completed by any daemon.");
+    return;
+  }
+  if (reason == REQUEUE_BUSY) {
+    if (++request->busyRetries >= BUSY_RETRY_LIMIT) {
+      finishRequest(client, request, OTP_FAILED, "The daemons were too busy to take the request.");
+      return;
+    }
+    for (int i = 1; i < request->busyRetries && backoff < BUSY_BACKOFF_MAX_MS; i++)
+      backoff *= 2;
+    request->notBefore = currentMilliseconds() + (backoff < BUSY_BACKOFF_MAX_MS ? backoff : BUSY_BACKOFF_MAX_MS);
+  }
+
+  appendRequest(&client->queueHead, &client->queueTail, request);
+}
+
+/* Takes a client, a request that's no longer on a connection, its status and the reason it didn't succeed (or NULL),
+ * then sets it aside to be handed over at the end of the poll, so callbacks never run while a connection is being
+ * worked on. */
+static void finishRequest(struct otpClient* client, struct otpRequest* request, int status, const char reason[]) {
+  request->status = status;
+  request->next = NULL;
+  if (status != OTP_OK) {
+    free(request->output);
+    request->output = NULL;
+  }
+  if (reason != NULL)
+    snprintf(request->error, sizeof(request->error), "%s", reason);
+  appendRequest(&client->finishedHead, &client->finishedTail, request);
+}
+
+/* Takes a client, then hands every finished request to its callback, or keeps it for otpNextResult if it has none.
+ * Returns the number of requests handed over. */
+static int deliverRequests(struct otpClient* client) {
+  struct otpRequest* request = NULL;
+  struct otpResult result;
+  otpCallback callback = NULL;
+  int delivered = 0;
+
+  while ((request = client->finishedHead) != NULL) {
+    client->finishedHead = request->next;
+    if (client->finishedHead == NULL)
+      client->finishedTail = NULL;
+    client->pending--;
+    delivered++;
+
+    if (request->callback == NULL) {
+      request->next = NULL;
+      appendRequest(&client->doneHead, &client->doneTail, request);
+      continue;
+    }
+
+    result.id = request->id;
+    result.status = request->status;
+    result.output = request->output;
+    result.length = request->length;
+    result.context = request->context;
+    strcpy(result.error, request->error);
+    callback = request->callback;
+    free(request);
+    callback(&result);
+  }
+
+  return(delivered);
+}
+
+// Takes the head and tail of a list of requests and a request, then adds the request to the end of the list
+static void appendRequest(struct otpRequest** head, struct otpRequest** tail, struct otpRequest* request) {
+  request->next = NULL;
+  if (*tail == NULL)
+    *head = request;
+  else
+    (*tail)->next = request;
+  *tail = request;
+}
+
+// Takes the head of a list of requests, then frees every request on it along with any output it has
+static void freeRequests(struct otpRequest* request) {
+  struct otpRequest* next = NULL;
+
+  while (request != NULL) {
+    next = request->next;
+    free(request->output);
+    free(request);
+    request = next;
+  }
+}
+
+// Returns the time on the monotonic clock in milliseconds
+static long long currentMilliseconds(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return((long long) now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+/* Takes a buffer and its length, then uses a loop starting from the beginning of the buffer to check one character at
+ * a time, ensuring that the character is either a space or uppercase letter. Exits the loop and returns true at the
+ * end of the buffer, or returns false when an invalid character is found that can't be sent to our daemon. */
+static int isValidString(const char buffer[], size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    if (!isupper(buffer[i]) && !isspace(buffer[i])) {
+      // Return false immediately if any character isn't valid
+      return(0);
+    }
+  }
+  return(1);
+}
@@ -0,0 +1,62 @@
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stddef.h>
+
+/* An asynchronous client for otp_enc_d and otp_dec_d that other programs can link against instead of running
+ * otp_enc or otp_dec for each message. Requests are submitted without blocking and sent over a pool of connections to
+ * one or more daemons, with many requests pipelined on each connection. Nothing is sent or received until otpPoll is
+ * called, which hands each finished request to its callback, or keeps it for otpNextResult if it has none. A client
+ * isn't thread safe, so each thread that uses one should create its own. */
+
+#define OTP_ENCRYPT 0
+#define OTP_DECRYPT 1
+
+// Request statuses: OTP_REJECTED means the daemon turned the request down, OTP_FAILED that no daemon could finish it
+#define OTP_OK 0
+#define OTP_REJECTED -1
+#define OTP_FAILED -2
+
+struct otpClient;
+
+/* A finished request. output holds the length characters of the encrypted or decrypted message followed by a null
+ * terminator, and belongs to whoever receives the result, who has to free it. It's NULL unless status is OTP_OK.
+ * Otherwise error says what went wrong. context is whatever was passed to otpSubmit. */
+struct otpResult {
+  long id;
+  int status;
+  char* output;
+  size_t length;
+  char error[128];
+  void* context;
+};
+
+typedef void (*otpCallback)(struct otpResult*);
+
+/* Takes a comma separated list of [HOST:]PORT endpoints, OTP_ENCRYPT or OTP_DECRYPT, and how many connections to
+ * keep to each endpoint (0 for the default), then creates a client. Connections are only opened once there are
+ * requests for them, and otpPoll closes them again once they've been idle for a second, since each one holds a daemon
+ * worker. Returns the client, or NULL if an endpoint couldn't be resolved or the client couldn't be allocated. */
+struct otpClient* otpCreateClient(const char[], int, int);
+
+/* Takes a client, a message and its key (both of which have to stay unchanged until the request finishes), the
+ * message length, and a callback (or NULL to collect the result with otpNextResult) with a context pointer for it,
+ * then queues the request. Returns the request's ID, or -1 if the message or key had invalid characters or the request
+ * couldn't be allocated. */
+long otpSubmit(struct otpClient*, const char[], const char[], size_t, otpCallback, void*);
+
+/* Takes a client and the most milliseconds to wait (-1 to wait until something finishes), then sends and receives
+ * whatever it can for the queued requests and finishes any that are done. Returns how many requests finished. */
+int otpPoll(struct otpClient*, int);
+
+/* Takes a client and a result to fill in, then hands over the oldest finished request that had no callback.
+ * Returns 1 if there was one, or 0 if not. */
+int otpNextResult(struct otpClient*, struct otpResult*);
+
+// Takes a client, then returns the number of requests that have been submitted but haven't finished
+size_t otpPending(const struct otpClient*);
+
+// Takes a client, then closes its connections and frees it, dropping any requests that haven't finished
+void otpDestroyClient(struct otpClient*);
+
+#endif
@@ -0,0 +1,128 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "otp_client.h"
+
+/* An example of embedding the client library: every file named on the command line is encrypted (or decrypted, with
+ * -d) with the same key through one client, so all of them are in flight at once, spread over the daemons given. The
+ * results are written to stdout in the order the files were given, one per line, the same as otp_enc would write
+ * them. */
+
+struct job {
+  const char* path;
+  char* message;
+  size_t length;
+  struct otpResult result;
+};
+
+void error(const char* msg);
+char* mapFile(const char[], size_t*);
+void storeResult(struct otpResult*);
+
+int main(int argc, char* argv[]) {
+  int operation = OTP_ENCRYPT, firstFile = 1, exitStatus = 0, jobCount = 0;
+  size_t keyLength = 0;
+  char* key = NULL;
+  struct job* jobs = NULL;
+  struct otpClient* client = NULL;
+
+  if (argc > 1 && strcmp(argv[1], "-d") == 0) {
+    operation = OTP_DECRYPT;
+    firstFile = 2;
+  }
+  if (argc - firstFile < 3) {
+    fprintf(stderr, "Correct command format: %s [-d] PORT[,PORT...] key file...\n", argv[0]);
+    exit(2);
+  }
+
+  client = otpCreateClient(argv[firstFile], operation, 0);
+  if (client == NULL) {
+    fprintf(stderr, "An error occurred defining a server address.\n");
+    exit(2);
+  }
+
+  key = mapFile(argv[firstFile + 1], &keyLength);
+  jobCount = argc - firstFile - 2;
+  jobs = malloc(jobCount * sizeof(struct job));
+  memset(jobs, '\0', jobCount * sizeof(struct job));
+
+  // Submit every file before waiting for any of them, leaving off the newline each one ends with
+  for (int i = 0; i < jobCount; i++) {
+    jobs[i].path = argv[firstFile + 2 + i];
+    jobs[i].message = mapFile(jobs[i].path, &jobs[i].length);
+    if (jobs[i].length > 0 && jobs[i].message[jobs[i].length - 1] == '\n')
+      jobs[i].length--;
+
+    if (jobs[i].length > keyLength) {
+      fprintf(stderr, "The key is too short for %s.\n", jobs[i].path);
+      exit(1);
+    }
+    if (otpSubmit(client, jobs[i].message, key, jobs[i].length, storeResult, &jobs[i]) < 0) {
+      fprintf(stderr, "One or more invalid characters were detected in %s.\n", jobs[i].path);
+      exit(1);
+    }
+  }
+
+  // Everything happens here, on this thread, until the last request has finished
+  while (otpPending(client) > 0)
+    otpPoll(client, -1);
+
+  for (int i = 0; i < jobCount; i++) {
+    if (jobs[i].result.status == OTP_OK) {
+      fwrite(jobs[i].result.output, sizeof(char), jobs[i].result.length, stdout);
+      fprintf(stdout, "\n");
+    } else {
+      fprintf(stderr, "%s: %s\n", jobs[i].path, jobs[i].result.error);
+      if (exitStatus == 0 || jobs[i].result.status == OTP_FAILED)
+        exitStatus = jobs[i].result.status == OTP_FAILED ? 2 : 1;
+    }
+    free(jobs[i].result.output);
+  }
+
+  otpDestroyClient(client);
+  free(jobs);
+  return(exitStatus);
+}
+
+// Error function used for reporting issues
+void error(const char* msg) {
+  perror(msg);
+  exit(2);
+}
+
+/* Takes the path of a file and somewhere to store its length, then maps the whole file into memory. The mapping stays
+ * in place until the program exits, since the library reads from it until each request is done. */
+char* mapFile(const char path[], size_t* fileLength) {
+  int fileDescriptor = open(path, O_RDONLY);
+  struct stat fileInfo;
+  char* contents = NULL;
+
+  if (fileDescriptor < 0 || fstat(fileDescriptor, &fileInfo) < 0)
+    error("Could not open the specified file");
+  *fileLength = fileInfo.st_size;
+
+  // An empty file can't be mapped, but there's nothing in it to point at anyway
+  if (*fileLength == 0) {
+    close(fileDescriptor);
+    return("");
+  }
+
+  contents = mmap(NULL, *fileLength, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+  if (contents == MAP_FAILED)
+    error("An error occurred mapping the file");
+  close(fileDescriptor);
+
+  return(contents);
+}
+
+// Takes a finished request's result, then keeps it with the job it belongs to until every job has finished
+void storeResult(struct otpResult* result) {
+  struct job* finishedJob = result->context;
+
+  finishedJob->result = *result;
+}
@@ -1,87 +1,414 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Small files aren't split so finely that connection setup outweighs the work done per stripe. Stripes are streamed
+ * through the daemons a chunk at a time, so there's no upper limit on their size. */
+#define MIN_STRIPE_SIZE 4096
+#define STREAM_CHUNK_SIZE 65536
+#define LOCAL_CHUNK_SIZE 65536
+#define RELEASE_SIZE (1024 * 1024)
+#define BUSY_RETRY_LIMIT 40
+#define BUSY_BACKOFF_MAX_US 1000000
+
+/* With --shm, stripes are handed to daemons on this host through a ring of shared memory set up over the daemon's
+ * Unix socket, so the message and key are never copied through a socket. */
+#define LOCAL_SOCKET_FORMAT "/tmp/otp_dec_d.%d.sock"
+#define RING_SLOT_COUNT 8
+#define RING_HEADER_SIZE 4096
+#define RING_DESCRIPTOR_COUNT 3
+
+/* Ciphertext written by otp_enc --container starts with a header line and is followed by an index of each chunk's
+ * checksum, then a fixed length trailer giving the index's offset. Only the chunks a --range falls in are read and
+ * checked. The key is identified by a hash of its first KEY_ID_LENGTH characters, which otp_enc never encrypts with,
+ * so the container's key offset is always past them. */
+#define CONTAINER_MAGIC "OTPC1"
+#define CONTAINER_HEADER_MAX_LENGTH 256
+#define CONTAINER_TRAILER_LENGTH 25
+#define INDEX_ENTRY_LENGTH 17
+#define KEY_ID_LENGTH 64
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+struct endpoint {
+  char host[256];
+  int portNumber;
+};
+
+/* The start of a shared memory ring, laid out the same way the daemons expect. produced counts the slots this
+ * process has filled and consumed counts the slots the daemon has decrypted. */
+struct ringHeader {
+  unsigned long produced;
+  unsigned long consumed;
+};
+
+struct stripe {
+  size_t offset;
+  size_t length;
+  size_t progress;
+  int endpointIndex;
+  int attempts;
+  pid_t pid;
+};
+
+void decrypt(char[], unsigned long, const char[]);
+void decryptLocally(const char[], const char[], size_t);
 void error(const char* msg);
-void fileToBuffer(const int*, char[], const int*);
-void receiveStringFromSocket(const int*, char[], char[], const int*, const char[]);
+char* mapFile(const int*, const size_t*);
+size_t fileLength(const int*);
+int parseEndpoints(const char[], struct endpoint**);
+int connectToEndpoint(const struct endpoint*);
+int decryptStripes(const struct endpoint*, int, const char[], const char[], char[], size_t);
+void notifyParent(int);
+void launchStripe(struct stripe*, const struct endpoint*, const char[], const char[], char[]);
+int openSession(const struct endpoint*);
+int runStripe(const struct endpoint*, const char[], const char[], char[], struct stripe*);
+int streamStripe(const int*, const char[], const char[], char[], size_t, struct stripe*);
+int ringStripe(const int*, const char[], const char[], char[], size_t, struct stripe*);
+int receiveStatusLine(const int*);
+int printDaemonStats(const struct endpoint*);
+int sendDescriptors(const int*, const int[], int);
+int waitForRing(const int*, int);
+int receiveStringFromSocket(const int*, char[], char[], const int*, const char[]);
+void sendBytesToSocket(const int*, const char[], size_t);
 void sendStringToSocket(const int*, const char[]);
-int isValidString(const char[]);
+int isValidString(const char[], size_t);
+unsigned long long hashBytes(unsigned long long, const char[], size_t);
+void writeOutput(const char[], size_t);
+int isContainer(const char[], size_t);
+char* openContainer(const char[], size_t, const char[], size_t, size_t, size_t, size_t*, size_t*);
+void corruptContainer(const char[]);
+
+int notifyPipe[2];
+int sharedMemoryMode = 0;
 
 int main(int argc, char *argv[]) {
-  int socketFD, portNumber;
-  int ciphertextFD, ciphertextLength, keyFD, keyLength;
-  int validText = 0, validKey = 0;
-  struct sockaddr_in serverAddress;
-  struct hostent* serverHostInfo;
-  int bufferSize = 150000, messageFragmentSize = 10;
-  char buffer[bufferSize], messageFragment[messageFragmentSize];
-  char connectionValidator[] = "<<";
-  char endOfMessage[] = "||";
+  int ciphertextFD, keyFD;
+  int validText = 0, validKey = 0, endpointCount = 0, exitStatus = 0, localMode = 0, statsMode = 0, option;
+  int rangeRequested = 0;
+  size_t ciphertextLength = 0, keyLength = 0, keyOffset = 0, messageLength = 0, rangeStart = 0, rangeEnd = 0;
+  char* ciphertext = NULL;
+  char* key = NULL;
+  char* plaintext = NULL;
+  struct endpoint* endpoints = NULL;
+  struct option longOptions[] = {
+    {"local", no_argument, NULL, 'l'},
+    {"shm", no_argument, NULL, 's'},
+    {"stats", no_argument, NULL, 'q'},
+    {"range", required_argument, NULL, 'r'},
+    {"key-offset", required_argument, NULL, 'k'},
+    {NULL, 0, NULL, 0}
+  };
 
-  // Check usage & args
-  if (argc < 4) {
-    fprintf(stderr, "Correct command format: %s CIPHERTEXT KEY PORT\n", argv[0]);
+  // Check usage & args. The daemon's port isn't needed when decrypting in this process with --local.
+  while ((option = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+    if (option == 'l')
+      localMode = 1;
+    else if (option == 's')
+      sharedMemoryMode = 1;
+    else if (option == 'q')
+      statsMode = 1;
+    else if (option == 'r' && sscanf(optarg, "%zu-%zu", &rangeStart, &rangeEnd) == 2)
+      rangeRequested = 1;
+    else if (option == 'k')
+      keyOffset = strtoul(optarg, NULL, 10);
+    else
+      exit(2);
+  }
+  if (argc - optind < (statsMode ? 1 : localMode ? 2 : 3)) {
+    fprintf(stderr, "Correct command format: %s [--shm] [--range X-Y] [--key-offset N] CIPHERTEXT KEY "
+                    "PORT[,[HOST:]PORT...]\n"
+                    "                    or: %s --local [--range X-Y] [--key-offset N] CIPHERTEXT KEY\n"
+                    "                    or: %s --stats [HOST:]PORT\n", argv[0], argv[0], argv[0]);
     exit(2);
   }
 
+  // Print the daemon's metrics instead of decrypting anything
+  if (statsMode) {
+    if (parseEndpoints(argv[optind], &endpoints) < 1) {
+      fprintf(stderr, "An error occurred defining a server address.\n");
+      exit(2);
+    }
+    exitStatus = printDaemonStats(&endpoints[0]);
+    free(endpoints);
+    return(exitStatus);
+  }
+
   /* Open the specified ciphertext and key files, checking for existence and setting the length of each file in
    * bytes so we can verify the key we'll send to the daemon is long enough to decrypt the ciphertext message. */
-  ciphertextFD = open(argv[1], O_RDONLY);
+  ciphertextFD = open(argv[optind], O_RDONLY);
   if (ciphertextFD < 0)
     error("Could not open the specified ciphertext file");
   /* Set the length of the provided ciphertext equal to the size of the file
    * (source: https://stackoverflow.com/questions/174531/how-to-read-the-content-of-a-file-to-a-string-in-c). */
-  ciphertextLength = lseek(ciphertextFD, 0, SEEK_END);
+  ciphertextLength = fileLength(&ciphertextFD);
 
   // Repeat the above steps for our key to get its size.
-  keyFD = open(argv[2], O_RDONLY);
+  keyFD = open(argv[optind + 1], O_RDONLY);
   if (keyFD < 0)
     error("Could not open the specified key file");
-  keyLength = lseek(keyFD, 0, SEEK_END);
+  keyLength = fileLength(&keyFD);
 
-  // Print an error message and exit if the key is too short to use.
-  if (keyLength < ciphertextLength) {
-    fprintf(stderr, "The provided key does not meet the minimum length requirements to "
-                    "decrypt your message.\nPlease provide a key with a length of %d or more.\n", ciphertextLength - 1);
-    close(ciphertextFD);
-    close(keyFD);
-    exit(1);
+  // Map the ciphertext and key into memory. Pages are only read from the files when they're used.
+  ciphertext = mapFile(&ciphertextFD, &ciphertextLength);
+  key = mapFile(&keyFD, &keyLength);
+  close(ciphertextFD);
+  close(keyFD);
+
+  // The newline that terminates the key file isn't part of the pad
+  if (keyLength > 0 && key[keyLength - 1] == '\n')
+    keyLength--;
+
+  /* A container records the key offset it was encrypted with, and only the part of it being decrypted (and the
+   * matching part of the key) is checked and sent to the daemons. */
+  if (isContainer(ciphertext, ciphertextLength)) {
+    if (keyOffset > 0) {
+      fprintf(stderr, "A container records its own key offset, so --key-offset can't be used with it.\n");
+      exit(1);
+    }
+    ciphertext = openContainer(ciphertext, ciphertextLength, key, keyLength, rangeRequested ? rangeStart : 0,
+                               rangeRequested ? rangeEnd : SIZE_MAX, &messageLength, &keyOffset);
+    key += keyOffset;
+  } else {
+    if (rangeRequested) {
+      fprintf(stderr, "Only ciphertext written with otp_enc --container can be decrypted by range.\n");
+      exit(1);
+    }
+
+    // The message sent to the daemons ends at the newline that terminates the ciphertext file
+    messageLength = ciphertextLength;
+    if (messageLength > 0 && ciphertext[messageLength - 1] == '\n')
+      messageLength--;
+
+    /* Print an error message and exit if the key is too short to use. With --key-offset, the key is used from that
+     * many characters in, so one key file can be used for several messages. */
+    if (keyOffset > keyLength || keyLength - keyOffset < messageLength) {
+      fprintf(stderr, "The provided key does not meet the minimum length requirements to "
+                      "decrypt your message.\nPlease provide a key with a length of %zu or more.\n",
+                      keyOffset + messageLength);
+      exit(1);
+    }
+
+    /* Pass the message and key to isValidString to make sure that the message has characters that can be decrypted
+     * and the key has characters that can be used to decrypt our message. */
+    validText = isValidString(ciphertext, ciphertextLength);
+    validKey = isValidString(key + keyOffset, keyLength - keyOffset);
+
+    // Print an error message and exit before attempting to connect if either the message or key were invalid
+    if (!validText || !validKey) {
+      fprintf(stderr, "One or more invalid characters were detected.\n");
+      exit(1);
+    }
+    key += keyOffset;
   }
 
-  /* Store the encrypted message in our buffer, then pass the buffer to isValidString to make sure that the message has
- * characters that can be decrypted */
-  memset(buffer, '\0', sizeof(buffer));
-  fileToBuffer(&ciphertextFD, buffer, &ciphertextLength);
-  validText = isValidString(buffer);
+  // Skip the daemons entirely and write the result as it's decrypted, if they're not needed
+  if (localMode) {
+    decryptLocally(ciphertext, key, messageLength);
+    return(0);
+  }
 
-  /* Store the key in our buffer, then pass the buffer to isValidString to make sure that the message has
-* characters that can be used to decrypt our message */
-  memset(buffer, '\0', sizeof(buffer));
-  fileToBuffer(&keyFD, buffer, &keyLength);
-  validKey = isValidString(buffer);
+  endpointCount = parseEndpoints(argv[optind + 2], &endpoints);
+  if (endpointCount < 1) {
+    fprintf(stderr, "An error occurred defining a server address.\n");
+    exit(2);
+  }
 
-  // Print an error message and exit before attempting to connect if either the message or key were invalid
-  if (!validText || !validKey) {
-    fprintf(stderr, "One or more invalid characters were detected.\n");
-    close(ciphertextFD);
-    close(keyFD);
-    exit(1);
+  // Shared memory only reaches daemons on this host
+  for (int i = 0; i < endpointCount && sharedMemoryMode; i++) {
+    if (strcmp(endpoints[i].host, "localhost") != 0 && strcmp(endpoints[i].host, "127.0.0.1") != 0) {
+      fprintf(stderr, "--shm can only be used with daemons on this host.\n");
+      exit(2);
+    }
+  }
+
+  /* Stripe children write their part of the plaintext straight into a shared mapping, so the output can be
+   * written to stdout in order as it arrives. */
+  plaintext = mmap(NULL, messageLength + 1, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (plaintext == MAP_FAILED)
+    error("An error occurred allocating the output buffer");
+
+  exitStatus = decryptStripes(endpoints, endpointCount, ciphertext, key, plaintext, messageLength);
+
+  // Finish the decrypted result on stdout with a newline
+  if (exitStatus == 0)
+    fprintf(stdout, "\n");
+
+  free(endpoints);
+  return(exitStatus);
+}
+
+/* Takes a string, the string's message length, and a key, then translates the ASCII value of each character
+ * into a number between 0 and 26. The message character's value is subtracted by the key character's value
+ * (adding 27 if we get a negative result from subtraction) then modular arithmetic decrypts the result.
+ * Finally, we translate each character back into an ASCII value and add a null terminator to the end of the string.
+ * This is the same transform otp_dec_d uses. */
+void decrypt(char message[], const unsigned long messageLength, const char key[]) {
+  int ciphertextValue = -1, keyValue = -1, decryptedValue = -1;
+
+  for (size_t i = 0; i < messageLength; i++) {
+    /* Adjust spaces to equal the last value in our range, 26, so we can properly calculate the decrypted value with
+     * modular arithmetic. */
+    if ((int) message[i] == 32)
+      ciphertextValue = 26;
+    else
+      ciphertextValue = (int) (message[i] - 65);
+
+    if ((int) key[i] == 32)
+      keyValue = 26;
+    else
+      keyValue = (int) (key[i] - 65);
+
+    decryptedValue = ciphertextValue - keyValue;
+    if (decryptedValue < 0)
+      decryptedValue += 27;
+    decryptedValue %= 27;
+
+    if (decryptedValue == 26)
+      message[i] = (char) 32;
+    else
+      message[i] = (char) (decryptedValue + 65);
+  }
+  message[messageLength] = '\0';
+}
+
+/* Takes the mapped message and key and the length of the message, then decrypts the message one chunk at a time in a
+ * small buffer, writing each chunk to stdout as soon as it's done. The output matches what the daemons produce. */
+void decryptLocally(const char message[], const char key[], size_t messageLength) {
+  char buffer[LOCAL_CHUNK_SIZE + 1];
+  size_t chunkLength = 0;
+
+  for (size_t offset = 0; offset < messageLength; offset += chunkLength) {
+    chunkLength = messageLength - offset < LOCAL_CHUNK_SIZE ? messageLength - offset : LOCAL_CHUNK_SIZE;
+    memcpy(buffer, message + offset, chunkLength);
+    decrypt(buffer, chunkLength, key + offset);
+    writeOutput(buffer, chunkLength);
+  }
+
+  // Output the trailing newline the daemon path prints after the decrypted message
+  fprintf(stdout, "\n");
+}
+
+// Error function used for reporting issues
+void error(const char* msg) {
+  perror(msg);
+  exit(2);
+}
+
+/* Takes a file descriptor pointer and a pointer to the length of the file, then maps the whole file read-only so
+ * stripes of any size can be sliced out of it without copying. Pages are only read when they're used. Empty files
+ * map to an empty string. */
+char* mapFile(const int* fileDescriptor, const size_t* fileLength) {
+  char* contents = NULL;
+
+  if (*fileLength == 0)
+    return("");
+
+  contents = mmap(NULL, *fileLength, PROT_READ, MAP_PRIVATE, *fileDescriptor, 0);
+  if (contents == MAP_FAILED)
+    error("An error occurred trying to read file contents");
+
+  return(contents);
+}
+
+// Takes a file descriptor pointer, then returns the size of the file in bytes, exiting with an error if it has none
+size_t fileLength(const int* fileDescriptor) {
+  off_t length = lseek(*fileDescriptor, 0, SEEK_END);
+
+  if (length < 0)
+    error("An error occurred finding the length of a file");
+
+  return((size_t) length);
+}
+
+/* Takes a comma separated list of endpoints, each either a port number or a host and port number separated by a
+ * colon, and stores them in a newly allocated array. Returns the number of endpoints, or -1 if any were invalid. */
+int parseEndpoints(const char list[], struct endpoint** endpoints) {
+  int endpointCount = 1, index = 0;
+  const char* start = list;
+
+  for (size_t i = 0; i < strlen(list); i++) {
+    if (list[i] == ',')
+      endpointCount++;
+  }
+
+  *endpoints = malloc(endpointCount * sizeof(struct endpoint));
+  memset(*endpoints, '\0', endpointCount * sizeof(struct endpoint));
+
+  while (index < endpointCount) {
+    size_t length = strcspn(start, ",");
+    const char* colon = memchr(start, ':', length);
+    const char* port = start;
+
+    // Default to localhost when only a port number was provided, as the clients always have
+    if (colon == NULL) {
+      strcpy((*endpoints)[index].host, "localhost");
+    } else {
+      if (colon == start || colon - start >= sizeof((*endpoints)[index].host))
+        return(-1);
+      memcpy((*endpoints)[index].host, start, colon - start);
+      port = colon + 1;
+    }
+
+    (*endpoints)[index].portNumber = atoi(port); // Get the port number, convert to an integer from a string
+    if ((*endpoints)[index].portNumber <= 0)
+      return(-1);
+
+    start += length + 1;
+    index++;
+  }
+
+  return(endpointCount);
+}
+
+/* Takes an endpoint, resolves its host name and connects a new socket to it, exiting with an error if any step
+ * fails. With --shm, the daemon's Unix socket for the endpoint's port is connected to instead. Only called from
+ * stripe children, so exiting hands the stripe back to the parent to retry elsewhere. */
+int connectToEndpoint(const struct endpoint* target) {
+  int socketFD, noDelay = 1;
+  struct sockaddr_in serverAddress;
+  struct sockaddr_un localAddress;
+  struct hostent* serverHostInfo;
+
+  if (sharedMemoryMode) {
+    memset((char*) &localAddress, '\0', sizeof(localAddress));
+    localAddress.sun_family = AF_UNIX;
+    snprintf(localAddress.sun_path, sizeof(localAddress.sun_path), LOCAL_SOCKET_FORMAT, target->portNumber);
+
+    socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFD < 0)
+      error("An error occurred creating a socket");
+    if (connect(socketFD, (struct sockaddr*) &localAddress, sizeof(localAddress)) < 0)
+      error("An error occurred connecting to the server");
+
+    return(socketFD);
   }
 
   // Set up the server address struct
   memset((char*) &serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
-  portNumber = atoi(argv[3]); // Get the port number, convert to an integer from a string
   serverAddress.sin_family = AF_INET; // Create a network-capable socket
-  serverAddress.sin_port = htons(portNumber); // Store the port number
-  serverHostInfo = gethostbyname("localhost"); // Convert the machine name into a special form of address
+  serverAddress.sin_port = htons(target->portNumber); // Store the port number
+  serverHostInfo = gethostbyname(target->host); // Convert the machine name into a special form of address
 
   if (serverHostInfo == NULL) {
     fprintf(stderr, "An error occurred defining a server address.\n");
@@ -98,6 +425,166 @@ int main(int argc, char *argv[]) {
   if (connect(socketFD, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) < 0) // Connect socket to address
     error("An error occurred connecting to the server");
 
+  // Send the request header and small requests right away instead of waiting for the handshake to be acknowledged
+  setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+  return(socketFD);
+}
+
+/* Takes the list of endpoints, the mapped message and key, the shared output buffer and the message length, then
+ * splits the message into offset-aligned stripes so that message character i is always decrypted with key
+ * character i. Up to one stripe per endpoint runs at a time, each in its own child process. Children record how much
+ * of their stripe has arrived as they go, and the in-order prefix of the output is written to stdout as soon as it's
+ * complete. A stripe that fails is resumed from where it stopped on the next endpoint in the list, until every
+ * endpoint has been tried. Returns the exit status to use. */
+int decryptStripes(const struct endpoint* endpoints, int endpointCount, const char message[], const char key[], char output[], size_t messageLength) {
+  int stripeCount = 1, nextStripe = 0, running = 0, completed = 0, flushedStripe = 0;
+  int exitMethod = -5;
+  size_t stripeSize = messageLength, flushed = 0, released = 0;
+  struct stripe* stripes = NULL;
+  struct sigaction notifyAction;
+  struct pollfd notification;
+  char drain[64];
+  pid_t finishedPid = -5;
+
+  // Use one stripe per endpoint, unless that would make stripes too small to be worth a connection
+  if (messageLength > MIN_STRIPE_SIZE)
+    stripeCount = (messageLength + MIN_STRIPE_SIZE - 1) / MIN_STRIPE_SIZE;
+  if (stripeCount > endpointCount)
+    stripeCount = endpointCount;
+  if (stripeCount > 1)
+    stripeSize = (messageLength + stripeCount - 1) / stripeCount;
+
+  // The stripes are shared with the children so the parent can see how far along each of them is
+  stripes = mmap(NULL, stripeCount * sizeof(struct stripe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stripes == MAP_FAILED)
+    error("An error occurred allocating the stripes");
+  for (int i = 0; i < stripeCount; i++) {
+    stripes[i].offset = i * stripeSize;
+    stripes[i].length = (i == stripeCount - 1) ? messageLength - stripes[i].offset : stripeSize;
+    stripes[i].progress = 0;
+    stripes[i].endpointIndex = i % endpointCount;
+    stripes[i].attempts = 0;
+    stripes[i].pid = -5;
+  }
+
+  /* Children write a byte to this pipe whenever more of their stripe has arrived, and the SIGCHLD handler writes one
+   * whenever a child exits, so the parent can sleep in poll until there's either output to write or a stripe to
+   * reap. Both ends are non-blocking so nobody ever waits on a full pipe. */
+  if (pipe(notifyPipe) < 0)
+    error("An error occurred creating a pipe");
+  fcntl(notifyPipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(notifyPipe[1], F_SETFL, O_NONBLOCK);
+  memset(&notifyAction, '\0', sizeof(notifyAction));
+  notifyAction.sa_handler = notifyParent;
+  notifyAction.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &notifyAction, NULL);
+  notification.fd = notifyPipe[0];
+  notification.events = POLLIN;
+
+  while (completed < stripeCount) {
+    // Start new stripes until every endpoint has one in flight
+    while (running < endpointCount && nextStripe < stripeCount) {
+      launchStripe(&stripes[nextStripe], endpoints, message, key, output);
+      nextStripe++;
+      running++;
+    }
+
+    if (poll(&notification, 1, -1) < 0 && errno != EINTR)
+      error("An error occurred waiting for a stripe");
+    while (read(notifyPipe[0], drain, sizeof(drain)) > 0);
+
+    while ((finishedPid = waitpid(-1, &exitMethod, WNOHANG)) > 0) {
+      for (int i = 0; i < stripeCount; i++) {
+        if (stripes[i].pid != finishedPid)
+          continue;
+
+        stripes[i].pid = -5;
+        running--;
+
+        if (WIFEXITED(exitMethod) && WEXITSTATUS(exitMethod) == 0) {
+          completed++;
+        } else if (++stripes[i].attempts < endpointCount) {
+          // Hand what's left of the failed stripe to the next endpoint, alongside whatever it's already doing
+          stripes[i].endpointIndex = (stripes[i].endpointIndex + 1) % endpointCount;
+          launchStripe(&stripes[i], endpoints, message, key, output);
+          running++;
+        } else {
+          // Every endpoint has failed this stripe, so stop the remaining stripes and give up
+          for (int j = 0; j < stripeCount; j++) {
+            if (stripes[j].pid > 0)
+              kill(stripes[j].pid, SIGTERM);
+          }
+          while (wait(NULL) > 0);
+          munmap(stripes, stripeCount * sizeof(struct stripe));
+          return(WIFEXITED(exitMethod) ? WEXITSTATUS(exitMethod) : 2);
+        }
+        break;
+      }
+    }
+
+    // Write out everything that's arrived in order so far
+    while (flushedStripe < stripeCount) {
+      size_t progress = __atomic_load_n(&stripes[flushedStripe].progress, __ATOMIC_ACQUIRE);
+      size_t end = stripes[flushedStripe].offset + progress;
+
+      if (end > flushed) {
+        writeOutput(output + flushed, end - flushed);
+        fflush(stdout);
+        flushed = end;
+      }
+      if (progress < stripes[flushedStripe].length)
+        break;
+      flushedStripe++;
+    }
+
+    // Give the pages that have been written back to the system, so large jobs don't hold their whole output
+    if (flushed - released >= RELEASE_SIZE) {
+      size_t releaseEnd = flushed / RELEASE_SIZE * RELEASE_SIZE;
+      madvise(output + released, releaseEnd - released, MADV_REMOVE);
+      released = releaseEnd;
+    }
+  }
+
+  munmap(stripes, stripeCount * sizeof(struct stripe));
+  return(0);
+}
+
+// Signal handler that wakes the parent's poll when a stripe child exits
+void notifyParent(int signalNumber) {
+  int savedErrno = errno;
+  write(notifyPipe[1], "", 1);
+  errno = savedErrno;
+}
+
+/* Takes a stripe, the list of endpoints, the mapped message and key, and the shared output buffer, then forks a
+ * child process that sends the stripe to its current endpoint and exits with the stripe's result. Only the parent
+ * records the process ID, since the stripe is shared and the child would otherwise overwrite it with 0. */
+void launchStripe(struct stripe* job, const struct endpoint* endpoints, const char message[], const char key[], char output[]) {
+  pid_t spawnPid = fork();
+
+  switch (spawnPid) {
+    case -1:
+      error("An error occurred creating a process to send a stripe");
+    case 0:
+      signal(SIGCHLD, SIG_DFL);
+      exit(runStripe(&endpoints[job->endpointIndex], message, key, output, job));
+    default:
+      job->pid = spawnPid;
+      break;
+  }
+}
+
+/* Takes an endpoint, connects to it and performs the usual handshake, making sure the daemon is otp_dec_d.
+ * Returns the connected socket, or -1 if a different program answered. */
+int openSession(const struct endpoint* target) {
+  int socketFD, messageFragmentSize = 10;
+  char buffer[256], messageFragment[messageFragmentSize];
+  char connectionValidator[] = "<<";
+  char endOfMessage[] = "||";
+
+  socketFD = connectToEndpoint(target);
+
   // Send message to server
   sendStringToSocket(&socketFD, "<<||");
 
@@ -108,66 +595,322 @@ int main(int argc, char *argv[]) {
   if (strcmp(buffer, connectionValidator) != 0) {
     // Close the socket and clean up since the message received suggests this wasn't the right daemon
     close(socketFD);
-    // Close file descriptors
-    close(ciphertextFD);
-    close(keyFD);
     fprintf(stderr, "A connection was made to an unknown destination.\n");
-    exit(2);
+    return(-1);
+  }
+
+  return(socketFD);
+}
+
+/* Takes an endpoint, the mapped message and key, the shared output buffer and a stripe, then asks the daemon to
+ * stream back (or decrypt in shared memory, with --shm) whatever part of the stripe hasn't arrived yet. A daemon
+ * that's too busy for a bulk request right now is asked again after a growing delay. Returns 0 once the whole stripe
+ * has been decrypted, or 2 if the stripe should be retried elsewhere. */
+int runStripe(const struct endpoint* target, const char message[], const char key[], char output[], struct stripe* job) {
+  int socketFD, result = -5, busyRetries = 0;
+  char header[64];
+  size_t resumeFrom = job->progress, offset = job->offset + job->progress;
+  useconds_t backoff = 50000;
+
+  while (1) {
+    socketFD = openSession(target);
+    if (socketFD < 0)
+      return(2);
+
+    if (sharedMemoryMode) {
+      result = ringStripe(&socketFD, message + offset, key + offset, output + offset, job->length - resumeFrom, job);
+    } else {
+      // Ask for the rest of the stripe to be streamed back, one chunk at a time
+      snprintf(header, sizeof(header), "#S %zu %d\n", job->length - resumeFrom, STREAM_CHUNK_SIZE);
+      sendStringToSocket(&socketFD, header);
+      result = streamStripe(&socketFD, message + offset, key + offset, output + offset, job->length - resumeFrom, job);
+    }
+    close(socketFD); // Close the socket
+
+    if (result != -2 || ++busyRetries >= BUSY_RETRY_LIMIT)
+      break;
+    usleep(backoff);
+    backoff = backoff * 2 < BUSY_BACKOFF_MAX_US ? backoff * 2 : BUSY_BACKOFF_MAX_US;
+  }
+
+  // A daemon that turned the request down has already had its reason printed
+  if (result == -3)
+    return(2);
+  if (result < 0) {
+    fprintf(stderr, "An incomplete response was received from %s:%d.\n", target->host, target->portNumber);
+    return(2);
+  }
+
+  return(0);
+}
+
+/* Takes a connected socket that a stream request has just been sent on, the message and key to send, where the
+ * decrypted message belongs in the shared output buffer, the number of characters to send and the stripe they belong
+ * to. The message and key are sent interleaved, one chunk of each at a time, while the daemon's status line and then
+ * the decrypted chunks are read back as they arrive. Sending and receiving happen together, so the daemon is never
+ * left waiting on a client that's still busy sending. Returns 0 once everything has arrived, -2 if the daemon was
+ * too busy to take the request, -3 if it turned the request down, or -1 on any other failure. */
+int streamStripe(const int* socketFD, const char message[], const char key[], char output[], size_t length, struct stripe* job) {
+  struct pollfd connection;
+  char status[128];
+  size_t sent = 0, received = 0, statusLength = 0, streamLength = 2 * length;
+  size_t resumeFrom = job->progress;
+  int statusDone = 0;
+  ssize_t charsMoved = -5;
+
+  fcntl(*socketFD, F_SETFL, O_NONBLOCK);
+  connection.fd = *socketFD;
+
+  while (!statusDone || received < length) {
+    connection.events = POLLIN | (sent < streamLength ? POLLOUT : 0);
+    if (poll(&connection, 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return(-1);
+    }
+
+    if (connection.revents & POLLOUT) {
+      // Work out which chunk, and whether its message or key half, the next byte in the stream comes from
+      size_t chunkStart = sent / (2 * STREAM_CHUNK_SIZE) * STREAM_CHUNK_SIZE;
+      size_t chunkLength = length - chunkStart < STREAM_CHUNK_SIZE ? length - chunkStart : STREAM_CHUNK_SIZE;
+      size_t withinChunk = sent - 2 * chunkStart;
+
+      if (withinChunk < chunkLength)
+        charsMoved = send(*socketFD, message + chunkStart + withinChunk, chunkLength - withinChunk, 0);
+      else
+        charsMoved = send(*socketFD, key + chunkStart + withinChunk - chunkLength, 2 * chunkLength - withinChunk, 0);
+
+      if (charsMoved < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return(-1);
+      if (charsMoved > 0)
+        sent += charsMoved;
+    }
+
+    if (connection.revents & (POLLIN | POLLHUP | POLLERR)) {
+      // The daemon's status line comes first, read a character at a time so none of the output is read with it
+      if (!statusDone)
+        charsMoved = recv(*socketFD, status + statusLength, 1, 0);
+      else
+        charsMoved = recv(*socketFD, output + received, length - received, 0);
+
+      if (charsMoved == 0 || (charsMoved < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        return(-1);
+      if (charsMoved < 0)
+        continue;
+
+      if (!statusDone) {
+        statusLength += charsMoved;
+        if (status[statusLength - 1] == '\n' || statusLength == sizeof(status) - 1) {
+          status[statusLength] = '\0';
+          if (status[0] == '~')
+            return(-2);
+          if (status[0] != '+') {
+            fprintf(stderr, "%s", status + 1);
+            return(-3);
+          }
+          statusDone = 1;
+        }
+      } else {
+        // Record how much of the stripe has arrived, and let the parent know so it can write it out
+        received += charsMoved;
+        __atomic_store_n(&job->progress, resumeFrom + received, __ATOMIC_RELEASE);
+        write(notifyPipe[1], "", 1);
+      }
+    }
+  }
+
+  return(0);
+}
+
+/* Takes a socket connected to a daemon's Unix socket, the message and key to send, where the decrypted message
+ * belongs in the shared output buffer, the number of characters to send and the stripe they belong to. A ring of
+ * shared memory and two event counters are created and handed to the daemon once it accepts the request. Slots are
+ * filled with a chunk of message followed by the same length of key, and the daemon decrypts each slot's message in
+ * place. Filling and collecting happen together, so the ring is refilled as soon as slots have been collected.
+ * Returns 0 once everything has arrived, -2 if the daemon was too busy to take the request, -3 if it turned the
+ * request down, or -1 on any other failure. */
+int ringStripe(const int* socketFD, const char message[], const char key[], char output[], size_t length, struct stripe* job) {
+  size_t ringSize = RING_HEADER_SIZE + RING_SLOT_COUNT * 2 * STREAM_CHUNK_SIZE;
+  size_t chunkCount = (length + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE, produced = 0, collected = 0;
+  size_t resumeFrom = job->progress, chunkStart = 0, chunkLength = 0;
+  int ringFDs[RING_DESCRIPTOR_COUNT] = {-1, -1, -1};
+  int result = -1;
+  char header[64];
+  char* ring = MAP_FAILED;
+  char* slot = NULL;
+  struct ringHeader* positions = NULL;
+  unsigned long long filled = 1;
+
+  // The ring lives in an anonymous file so it can be passed to the daemon, with counters for each side to wake the
+  // other. The file is sealed against shrinking once it's sized, so the daemon knows its mapping can't be cut short
+  // later.
+  ringFDs[0] = syscall(SYS_memfd_create, "otp ring", MFD_ALLOW_SEALING);
+  ringFDs[1] = eventfd(0, 0);
+  ringFDs[2] = eventfd(0, 0);
+  if (ringFDs[0] >= 0 && ftruncate(ringFDs[0], ringSize) == 0 && fcntl(ringFDs[0], F_ADD_SEALS, F_SEAL_SHRINK) == 0)
+    ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, ringFDs[0], 0);
+
+  if (ring != MAP_FAILED && ringFDs[1] >= 0 && ringFDs[2] >= 0) {
+    positions = (struct ringHeader*) ring;
+    snprintf(header, sizeof(header), "#R %zu %d %d\n", length, RING_SLOT_COUNT, STREAM_CHUNK_SIZE);
+    sendStringToSocket(socketFD, header);
+    result = receiveStatusLine(socketFD);
+    if (result == 0 && sendDescriptors(socketFD, ringFDs, RING_DESCRIPTOR_COUNT) < 0)
+      result = -1;
   } else {
-    // Send the ciphertext by storing it in the cleared buffer, closing the file descriptor and sending it through the socket
-    memset(buffer, '\0', sizeof(buffer));
-    fileToBuffer(&ciphertextFD, buffer, &ciphertextLength);
-    close(ciphertextFD);
-    sendStringToSocket(&socketFD, buffer);
+    fprintf(stderr, "An error occurred creating a shared memory ring.\n");
+  }
 
-    // Send the key by storing it in the cleared buffer, closing the file descriptor and sending it through the socket
-    memset(buffer, '\0', sizeof(buffer));
-    fileToBuffer(&keyFD, buffer, &keyLength);
-    close(keyFD);
-    sendStringToSocket(&socketFD, buffer);
+  while (result == 0 && collected < chunkCount) {
+    // Fill every slot that's free, then wake the daemon once for all of them
+    if (produced < chunkCount && produced - collected < RING_SLOT_COUNT) {
+      while (produced < chunkCount && produced - collected < RING_SLOT_COUNT) {
+        chunkStart = produced * STREAM_CHUNK_SIZE;
+        chunkLength = length - chunkStart < STREAM_CHUNK_SIZE ? length - chunkStart : STREAM_CHUNK_SIZE;
+        slot = ring + RING_HEADER_SIZE + (produced % RING_SLOT_COUNT) * 2 * STREAM_CHUNK_SIZE;
+        memcpy(slot, message + chunkStart, chunkLength);
+        memcpy(slot + STREAM_CHUNK_SIZE, key + chunkStart, chunkLength);
+        produced++;
+      }
+      __atomic_store_n(&positions->produced, produced, __ATOMIC_RELEASE);
+      write(ringFDs[1], &filled, sizeof(filled));
+    }
 
-    // Indicate to the server that both the ciphertext and key have been sent
-    sendStringToSocket(&socketFD, endOfMessage);
+    /* Collect whatever the daemon has decrypted, or wait for it if there's nothing yet. The daemon closes the socket
+     * as soon as it's decrypted the last slot, so that slot is checked for again before giving up. */
+    if (collected == __atomic_load_n(&positions->consumed, __ATOMIC_ACQUIRE)) {
+      if (waitForRing(socketFD, ringFDs[2]) < 0 && collected == __atomic_load_n(&positions->consumed, __ATOMIC_ACQUIRE))
+        result = -1;
+      continue;
+    }
+    while (collected < __atomic_load_n(&positions->consumed, __ATOMIC_ACQUIRE)) {
+      chunkStart = collected * STREAM_CHUNK_SIZE;
+      chunkLength = length - chunkStart < STREAM_CHUNK_SIZE ? length - chunkStart : STREAM_CHUNK_SIZE;
+      slot = ring + RING_HEADER_SIZE + (collected % RING_SLOT_COUNT) * 2 * STREAM_CHUNK_SIZE;
+      memcpy(output + chunkStart, slot, chunkLength);
+      collected++;
+    }
 
-    // Get return message from server
-    memset(buffer, '\0', sizeof(buffer)); // Clear out the buffer again for reuse
-    receiveStringFromSocket(&socketFD, buffer, messageFragment, &messageFragmentSize, endOfMessage);
+    // Record how much of the stripe has arrived, and let the parent know so it can write it out
+    __atomic_store_n(&job->progress, resumeFrom + (collected == chunkCount ? length : collected * STREAM_CHUNK_SIZE),
+                     __ATOMIC_RELEASE);
+    write(notifyPipe[1], "", 1);
+  }
 
-    // Output the decrypted result to stdout
-    fprintf(stdout, "%s\n", buffer);
+  if (ring != MAP_FAILED)
+    munmap(ring, ringSize);
+  for (int i = 0; i < RING_DESCRIPTOR_COUNT; i++) {
+    if (ringFDs[i] >= 0)
+      close(ringFDs[i]);
   }
 
-  close(socketFD); // Close the socket
+  return(result);
+}
+
+/* Takes a socket a request has just been sent on, then reads the daemon's status line a character at a time so
+ * nothing after it is read with it. Returns 0 if the request was accepted, -2 if the daemon was too busy for it, -3
+ * (after printing the daemon's reason) if it was turned down, or -1 if the connection ended first. */
+int receiveStatusLine(const int* socketFD) {
+  char status[128];
+  size_t statusLength = 0;
+
+  do {
+    if (recv(*socketFD, status + statusLength, 1, 0) <= 0)
+      return(-1);
+    statusLength++;
+  } while (status[statusLength - 1] != '\n' && statusLength < sizeof(status) - 1);
+  status[statusLength] = '\0';
+
+  if (status[0] == '~')
+    return(-2);
+  if (status[0] != '+') {
+    fprintf(stderr, "%s", status + 1);
+    return(-3);
+  }
 
   return(0);
 }
 
-// Error function used for reporting issues
-void error(const char* msg) {
-  perror(msg);
-  exit(2);
+/* Takes an endpoint, then asks the daemon there for its metrics with a "#Q" request and copies them to stdout until
+ * the daemon closes the connection. Returns the exit status to use. */
+int printDaemonStats(const struct endpoint* target) {
+  int socketFD = openSession(target);
+  char buffer[4096];
+  ssize_t charsRead = -5;
+
+  if (socketFD < 0)
+    return(2);
+
+  sendStringToSocket(&socketFD, "#Q\n");
+  if (receiveStatusLine(&socketFD) != 0) {
+    close(socketFD);
+    return(2);
+  }
+  while ((charsRead = recv(socketFD, buffer, sizeof(buffer), 0)) > 0)
+    fwrite(buffer, sizeof(char), charsRead, stdout);
+
+  close(socketFD); // Close the socket
+  return(charsRead < 0 ? 2 : 0);
 }
 
-/* Takes a file descriptor pointer, a buffer to store the file's contents and a pointer to the length of the file,
- * then uses the read function to store the provided number of bytes from the file into the buffer. */
-void fileToBuffer(const int* fileDescriptor, char buffer[], const int* fileLength) {
-  int bytesRead = -5;
-  lseek(*fileDescriptor, 0, SEEK_SET);
-  bytesRead = read(*fileDescriptor, buffer, *fileLength);
-  if (bytesRead < 0)
-    error("An error occurred trying to read file contents");
+/* Takes a socket connected to a daemon's Unix socket, an array of file descriptors and how many there are, then
+ * passes them to the daemon along with a single byte. Returns 0 on success, or -1 if they couldn't be sent. */
+int sendDescriptors(const int* socketFD, const int descriptors[], int descriptorCount) {
+  char marker = 'R';
+  char control[CMSG_SPACE(RING_DESCRIPTOR_COUNT * sizeof(int))];
+  struct iovec markerVector = {&marker, 1};
+  struct msghdr message;
+  struct cmsghdr* controlMessage = NULL;
+
+  memset(&message, '\0', sizeof(message));
+  memset(control, '\0', sizeof(control));
+  message.msg_iov = &markerVector;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = CMSG_SPACE(descriptorCount * sizeof(int));
+
+  controlMessage = CMSG_FIRSTHDR(&message);
+  controlMessage->cmsg_level = SOL_SOCKET;
+  controlMessage->cmsg_type = SCM_RIGHTS;
+  controlMessage->cmsg_len = CMSG_LEN(descriptorCount * sizeof(int));
+  memcpy(CMSG_DATA(controlMessage), descriptors, descriptorCount * sizeof(int));
+
+  return(sendmsg(*socketFD, &message, 0) == 1 ? 0 : -1);
+}
+
+/* Takes a socket and an event counter, then sleeps until the counter is added to, which is reset on waking. The
+ * socket is watched too, since nothing more is sent on it while a ring is in use, so anything arriving on it means
+ * the other side has gone away. Returns 0 once woken, or -1 if the other side has gone. */
+int waitForRing(const int* socketFD, int eventFD) {
+  struct pollfd watched[2];
+  unsigned long long count = 0;
+
+  watched[0].fd = eventFD;
+  watched[1].fd = *socketFD;
+  watched[0].events = watched[1].events = POLLIN;
+
+  if (poll(watched, 2, -1) < 0)
+    return(errno == EINTR ? 0 : -1);
+  if (watched[1].revents & (POLLIN | POLLHUP | POLLERR))
+    return(-1);
+  if (watched[0].revents & POLLIN)
+    read(eventFD, &count, sizeof(count));
+
+  return(0);
 }
 
 /* Takes a socket, a message buffer, a smaller array to hold characters as they're read, the size of the array, and a
  * small string used by client and server to indicate the end of a message. The function loops through until the
  * substring is found, as seen in the Network Clients video for block 4, repeatedly adding the message fragment
- * to the end of the message. The substring that marks the end of the message is then replaced with a null terminator. */
-void receiveStringFromSocket(const int* establishedConnectionFD, char message[], char messageFragment[], const int* messageFragmentSize, const char endOfMessage[]) {
+ * to the end of the message. The message length is tracked so each fragment is appended and searched without
+ * rescanning the whole message. The substring that marks the end of the message is then replaced with a null
+ * terminator. Returns -1 if the connection ended before the substring was found. */
+int receiveStringFromSocket(const int* establishedConnectionFD, char message[], char messageFragment[], const int* messageFragmentSize, const char endOfMessage[]) {
   int charsRead = -5;
-  long terminalLocation = -5;
+  size_t messageLength = strlen(message), searchFrom = 0;
+  char* terminalLocation = strstr(message, endOfMessage);
 
-  while (strstr(message, endOfMessage) == NULL) {
-    memset(messageFragment, '\0', *messageFragmentSize);
+  while (terminalLocation == NULL) {
     charsRead = recv(*establishedConnectionFD, messageFragment, *messageFragmentSize - 1, 0);
 
     // Exit the loop if we either don't read any more characters when receiving, or we failed to retrieve any characters
@@ -176,28 +919,31 @@ void receiveStringFromSocket(const int* establishedConnectionFD, char message[],
     if (charsRead == -1)
       break;
 
-    strcat(message, messageFragment);
+    // Only the new characters, and the few before them the substring could start in, need to be searched
+    searchFrom = messageLength >= strlen(endOfMessage) ? messageLength - strlen(endOfMessage) + 1 : 0;
+    memcpy(message + messageLength, messageFragment, charsRead);
+    messageLength += charsRead;
+    message[messageLength] = '\0';
+    terminalLocation = strstr(message + searchFrom, endOfMessage);
   }
 
-  /* Find the terminal location using the method in the Network Clients video from Block 4
-   * then set a null terminator after the actual message contents end. */
-  terminalLocation = strstr(message, endOfMessage) - message;
-  message[terminalLocation] = '\0';
+  if (terminalLocation == NULL)
+    return(-1);
+
+  // Set a null terminator after the actual message contents end
+  *terminalLocation = '\0';
+  return(0);
 }
 
-/* Takes a pointer to a socket, followed by a string to send via that socket,
- * then loops to ensure all the data in the string is sent. */
-void sendStringToSocket(const int* socketFD, const char message[]) {
-  int charsWritten;
-  // Send message to server
-  charsWritten = send(*socketFD, message, strlen(message), 0); // Write to the server
-  if (charsWritten < 0)
-    error("An error occurred writing to the socket");
+/* Takes a pointer to a socket, followed by a buffer and the number of bytes to send from it,
+ * then loops to ensure all the data in the buffer is sent. */
+void sendBytesToSocket(const int* socketFD, const char message[], size_t messageLength) {
+  size_t charsWritten = 0;
 
-  while (charsWritten < strlen(message)) {
+  while (charsWritten < messageLength) {
     int addedChars = 0;
-    // Write to the server again, starting from one character after the most recently sent character
-    addedChars = send(*socketFD, message + charsWritten, strlen(message) - charsWritten, 0);
+    // Write to the server, starting from one character after the most recently sent character
+    addedChars = send(*socketFD, message + charsWritten, messageLength - charsWritten, 0);
     if (addedChars < 0)
       error("An error occurred writing to the socket");
 
@@ -210,14 +956,127 @@ void sendStringToSocket(const int* socketFD, const char message[]) {
   }
 }
 
-/* Takes a string, then uses a loop starting from the beginning of the string to check one character at a time,
- * ensuring that the character is either a space or uppercase letter. Exits the loop and returns true at the end
- * of the string, or returns false when an invalid character is found that can't be sent to our daemon. */
-int isValidString(const char buffer[]) {
-  for (int i = 0; i < strlen(buffer); i++) {
+/* Takes a pointer to a socket, followed by a string to send via that socket,
+ * then loops to ensure all the data in the string is sent. */
+void sendStringToSocket(const int* socketFD, const char message[]) {
+  sendBytesToSocket(socketFD, message, strlen(message));
+}
+
+/* Takes a buffer and its length, then uses a loop starting from the beginning of the buffer to check one character at
+ * a time, ensuring that the character is either a space or uppercase letter. Exits the loop and returns true at the
+ * end of the buffer, or returns false when an invalid character is found that can't be sent to our daemon. */
+int isValidString(const char buffer[], size_t length) {
+  for (size_t i = 0; i < length; i++) {
     if (!isupper(buffer[i]) && !isspace(buffer[i])) {
+      // Return false immediately if any character
       return(0);
     }
   }
   return(1);
 }
+
+/* Takes a hash to continue from, a buffer and its length, then returns the 64-bit FNV-1a hash of the buffer's
+ * contents added to the hash. Starting from FNV_OFFSET_BASIS hashes just the buffer. */
+unsigned long long hashBytes(unsigned long long hash, const char buffer[], size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char) buffer[i];
+    hash *= FNV_PRIME;
+  }
+  return(hash);
+}
+
+// Takes part of the decrypted message and its length, then writes it to stdout
+void writeOutput(const char output[], size_t length) {
+  fwrite(output, sizeof(char), length, stdout);
+}
+
+// Takes the mapped ciphertext and its length, then returns whether it was written as a container
+int isContainer(const char ciphertext[], size_t ciphertextLength) {
+  return(ciphertextLength > strlen(CONTAINER_MAGIC) &&
+         memcmp(ciphertext, CONTAINER_MAGIC " ", strlen(CONTAINER_MAGIC) + 1) == 0);
+}
+
+/* Takes the mapped container and its length, the mapped key and its length, and the first and last characters of the
+ * range to decrypt (counting from 0, with a last character past the end meaning the rest of the message). The header
+ * and trailer are read to find the message and its index, the key is checked against the one the container was
+ * encrypted with, and only the chunks the range falls in are read and checked against their checksums. Exits with an
+ * error if any of that fails. Returns where the range starts in the container, and sets the length of the range and
+ * the offset of its key in the key file. */
+char* openContainer(const char container[], size_t containerLength, const char key[], size_t keyLength, size_t rangeStart, size_t rangeEnd, size_t* rangeLength, size_t* keyOffset) {
+  char header[CONTAINER_HEADER_MAX_LENGTH + 1], trailer[CONTAINER_TRAILER_LENGTH + 1];
+  const char* newline = memchr(container, '\n', containerLength < CONTAINER_HEADER_MAX_LENGTH ? containerLength : CONTAINER_HEADER_MAX_LENGTH);
+  const char* data = NULL;
+  const char* index = NULL;
+  size_t headerLength = 0, dataLength = 0, chunkSize = 0, chunkCount = 0, indexOffset = 0, indexedChunks = 0;
+  size_t chunkStart = 0, chunkLength = 0, rangeStop = 0;
+  unsigned long long keyId = 0;
+
+  if (newline == NULL)
+    corruptContainer("its header is missing");
+  headerLength = newline - container + 1;
+  memcpy(header, container, headerLength);
+  header[headerLength] = '\0';
+  if (sscanf(header, CONTAINER_MAGIC " key-id=%llx key-offset=%zu length=%zu chunk-size=%zu", &keyId, keyOffset,
+             &dataLength, &chunkSize) != 4 || chunkSize == 0)
+    corruptContainer("its header wasn't recognized");
+  chunkCount = (dataLength + chunkSize - 1) / chunkSize;
+  data = container + headerLength;
+
+  // The trailer gives where the index starts, which has to be just after the message and its newline
+  if (containerLength < headerLength + CONTAINER_TRAILER_LENGTH)
+    corruptContainer("it's too short");
+  memcpy(trailer, container + containerLength - CONTAINER_TRAILER_LENGTH, CONTAINER_TRAILER_LENGTH);
+  trailer[CONTAINER_TRAILER_LENGTH] = '\0';
+  if (sscanf(trailer, "end %zu", &indexOffset) != 1 || indexOffset != headerLength + dataLength + 1 ||
+      indexOffset >= containerLength - CONTAINER_TRAILER_LENGTH)
+    corruptContainer("its trailer doesn't match its header");
+  newline = memchr(container + indexOffset, '\n', containerLength - CONTAINER_TRAILER_LENGTH - indexOffset);
+  if (newline == NULL || sscanf(container + indexOffset, "index %zu", &indexedChunks) != 1 ||
+      indexedChunks != chunkCount ||
+      (size_t) (container + containerLength - CONTAINER_TRAILER_LENGTH - (newline + 1)) != chunkCount * INDEX_ENTRY_LENGTH)
+    corruptContainer("its index doesn't match its header");
+  index = newline + 1;
+
+  // Make sure the key is the one the container was encrypted with, and long enough for the message
+  if (hashBytes(FNV_OFFSET_BASIS, key, keyLength < KEY_ID_LENGTH ? keyLength : KEY_ID_LENGTH) != keyId) {
+    fprintf(stderr, "The provided key is not the key this container was encrypted with.\n");
+    exit(1);
+  }
+  if (*keyOffset > keyLength || keyLength - *keyOffset < dataLength) {
+    fprintf(stderr, "The provided key does not meet the minimum length requirements to "
+                    "decrypt your message.\nPlease provide a key with a length of %zu or more.\n", *keyOffset + dataLength);
+    exit(1);
+  }
+
+  // Decrypting the rest of the message also works for an empty one, but a range that was asked for can't be empty
+  rangeStop = rangeEnd == SIZE_MAX ? dataLength : rangeEnd + 1;
+  if (rangeStop > dataLength || rangeStart > rangeStop || (rangeStart == rangeStop && rangeEnd != SIZE_MAX)) {
+    fprintf(stderr, "The requested range is outside the %zu characters in the container.\n", dataLength);
+    exit(1);
+  }
+  *rangeLength = rangeStop - rangeStart;
+
+  // Check every chunk the range touches against its checksum in the index
+  for (size_t chunk = rangeStart / chunkSize; chunk * chunkSize < rangeStop; chunk++) {
+    chunkStart = chunk * chunkSize;
+    chunkLength = dataLength - chunkStart < chunkSize ? dataLength - chunkStart : chunkSize;
+    if (hashBytes(FNV_OFFSET_BASIS, data + chunkStart, chunkLength) != strtoull(index + chunk * INDEX_ENTRY_LENGTH, NULL, 16)) {
+      fprintf(stderr, "Chunk %zu of the container doesn't match its checksum.\n", chunk);
+      exit(1);
+    }
+  }
+
+  if (!isValidString(data + rangeStart, *rangeLength) || !isValidString(key + *keyOffset + rangeStart, *rangeLength)) {
+    fprintf(stderr, "One or more invalid characters were detected.\n");
+    exit(1);
+  }
+
+  *keyOffset += rangeStart;
+  return((char*) data + rangeStart);
+}
+
+// Takes the reason a container couldn't be read, then prints it and exits
+void corruptContainer(const char reason[]) {
+  fprintf(stderr, "The ciphertext looks like a container, but %s.\n", reason);
+  exit(1);
+}
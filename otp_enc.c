@@ -1,87 +1,435 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Small files aren't split so finely that connection setup outweighs the work done per stripe. Stripes are streamed
+ * through the daemons a chunk at a time, so there's no upper limit on their size. */
+#define MIN_STRIPE_SIZE 4096
+#define STREAM_CHUNK_SIZE 65536
+#define LOCAL_CHUNK_SIZE 65536
+#define RELEASE_SIZE (1024 * 1024)
+#define BUSY_RETRY_LIMIT 40
+#define BUSY_BACKOFF_MAX_US 1000000
+
+/* With --shm, stripes are handed to daemons on this host through a ring of shared memory set up over the daemon's
+ * Unix socket, so the message and key are never copied through a socket. */
+#define LOCAL_SOCKET_FORMAT "/tmp/otp_enc_d.%d.sock"
+#define RING_SLOT_COUNT 8
+#define RING_HEADER_SIZE 4096
+#define RING_DESCRIPTOR_COUNT 3
+
+/* With --container, the ciphertext is written after a header line and followed by an index of each chunk's checksum,
+ * then a fixed length trailer giving the index's offset, so otp_dec can check and decrypt any range of it without
+ * reading the rest. The key is identified by a hash of its first KEY_ID_LENGTH characters, which are kept out of the
+ * pad: a container's key offset starts past them, since a hash of characters that encrypted part of a message would
+ * let anyone with the container check guesses at that part. */
+#define CONTAINER_MAGIC "OTPC1"
+#define CONTAINER_CHUNK_SIZE 65536
+#define KEY_ID_LENGTH 64
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+struct endpoint {
+  char host[256];
+  int portNumber;
+};
+
+/* The start of a shared memory ring, laid out the same way the daemons expect. produced counts the slots this
+ * process has filled and consumed counts the slots the daemon has encrypted. */
+struct ringHeader {
+  unsigned long produced;
+  unsigned long consumed;
+};
+
+struct stripe {
+  size_t offset;
+  size_t length;
+  size_t progress;
+  int endpointIndex;
+  int attempts;
+  pid_t pid;
+};
+
+void encrypt(char[], unsigned long, const char[]);
+void encryptLocally(const char[], const char[], size_t);
 void error(const char* msg);
-void fileToBuffer(const int*, char[], const int*);
-void receiveStringFromSocket(const int*, char[], char[], const int*, const char[]);
+char* mapFile(const int*, const size_t*);
+size_t fileLength(const int*);
+int parseEndpoints(const char[], struct endpoint**);
+int connectToEndpoint(const struct endpoint*);
+int encryptStripes(const struct endpoint*, int, const char[], const char[], char[], size_t);
+void notifyParent(int);
+void launchStripe(struct stripe*, const struct endpoint*, const char[], const char[], char[]);
+int openSession(const struct endpoint*);
+int runStripe(const struct endpoint*, const char[], const char[], char[], struct stripe*);
+int streamStripe(const int*, const char[], const char[], char[], size_t, struct stripe*);
+int generateStripe(const int*, const char[], char[], char[], size_t, struct stripe*);
+int encryptWithGeneratedKey(const char[], const char[], const char[]);
+int ringStripe(const int*, const char[], const char[], char[], size_t, struct stripe*);
+int receiveStatusLine(const int*);
+int printDaemonStats(const struct endpoint*);
+int sendDescriptors(const int*, const int[], int);
+int waitForRing(const int*, int);
+int receiveStringFromSocket(const int*, char[], char[], const int*, const char[]);
+void sendBytesToSocket(const int*, const char[], size_t);
 void sendStringToSocket(const int*, const char[]);
-int isValidString(const char[]);
+int isValidString(const char[], size_t);
+unsigned long long hashBytes(unsigned long long, const char[], size_t);
+void writeOutput(const char[], size_t);
+void startContainer(const char[], size_t, size_t, size_t);
+void finishContainer(void);
+
+int notifyPipe[2];
+int sharedMemoryMode = 0;
+int containerMode = 0;
+size_t outputWritten = 0, containerHeaderLength = 0;
+unsigned long long* chunkChecksums = NULL;
+int generateMode = 0;
+const char* storedKeyName = NULL;
+char* generatedKey = NULL;
 
 int main(int argc, char *argv[]) {
-  int socketFD, portNumber;
-  int plaintextFD, plaintextLength, keyFD, keyLength;
-  int validText = 0, validKey = 0;
-  struct sockaddr_in serverAddress;
-  struct hostent* serverHostInfo;
-  int bufferSize = 150000, messageFragmentSize = 10;
-  char buffer[bufferSize], messageFragment[messageFragmentSize];
-  char connectionValidator[] = ">>";
-  char endOfMessage[] = "||";
+  int plaintextFD, keyFD;
+  int validText = 0, validKey = 0, endpointCount = 0, exitStatus = 0, localMode = 0, statsMode = 0, option;
+  int keyOffsetGiven = 0;
+  size_t plaintextLength = 0, keyLength = 0, keyOffset = 0, messageLength = 0;
+  char* plaintext = NULL;
+  char* key = NULL;
+  char* ciphertext = NULL;
+  struct endpoint* endpoints = NULL;
+  const char* generatedKeyPath = NULL;
+  struct option longOptions[] = {
+    {"local", no_argument, NULL, 'l'},
+    {"shm", no_argument, NULL, 's'},
+    {"stats", no_argument, NULL, 'q'},
+    {"container", no_argument, NULL, 'c'},
+    {"key-offset", required_argument, NULL, 'k'},
+    {"generate-key", required_argument, NULL, 'g'},
+    {"store-key", required_argument, NULL, 'K'},
+    {NULL, 0, NULL, 0}
+  };
 
-  // Check usage & args
-  if (argc < 4) {
-    fprintf(stderr, "Correct command format: %s PLAINTEXT KEY PORT\n", argv[0]);
+  // Check usage & args. The daemon's port isn't needed when encrypting in this process with --local.
+  while ((option = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+    if (option == 'l')
+      localMode = 1;
+    else if (option == 's')
+      sharedMemoryMode = 1;
+    else if (option == 'q')
+      statsMode = 1;
+    else if (option == 'c')
+      containerMode = 1;
+    else if (option == 'k') {
+      keyOffset = strtoul(optarg, NULL, 10);
+      keyOffsetGiven = 1;
+    }
+    else if (option == 'g')
+      generatedKeyPath = optarg;
+    else if (option == 'K')
+      storedKeyName = optarg;
+    else
+      exit(2);
+  }
+  generateMode = generatedKeyPath != NULL || storedKeyName != NULL;
+  if (argc - optind < (statsMode ? 1 : localMode || generateMode ? 2 : 3)) {
+    fprintf(stderr, "Correct command format: %s [--shm] [--container] [--key-offset N] PLAINTEXT KEY "
+                    "PORT[,[HOST:]PORT...]\n"
+                    "                    or: %s --local [--container] [--key-offset N] PLAINTEXT KEY\n"
+                    "                    or: %s --generate-key KEYFILE|--store-key NAME PLAINTEXT "
+                    "PORT[,[HOST:]PORT...]\n"
+                    "                    or: %s --stats [HOST:]PORT\n", argv[0], argv[0], argv[0], argv[0]);
+    exit(2);
+  }
+
+  // Print the daemon's metrics instead of encrypting anything
+  if (statsMode) {
+    if (parseEndpoints(argv[optind], &endpoints) < 1) {
+      fprintf(stderr, "An error occurred defining a server address.\n");
+      exit(2);
+    }
+    exitStatus = printDaemonStats(&endpoints[0]);
+    free(endpoints);
+    return(exitStatus);
+  }
+
+  // Have the daemons generate the key as they encrypt, instead of reading one from a file
+  if (generateMode) {
+    if (localMode || sharedMemoryMode || containerMode || keyOffset > 0 || (generatedKeyPath && storedKeyName)) {
+      fprintf(stderr, "A generated key can't be combined with --local, --shm, --container, --key-offset or another "
+                      "generated key.\n");
+      exit(2);
+    }
+    return(encryptWithGeneratedKey(argv[optind], argv[optind + 1], generatedKeyPath));
+  }
+
+  // The start of the key identifies it in a container, so the message is encrypted from after it
+  if (containerMode && !keyOffsetGiven)
+    keyOffset = KEY_ID_LENGTH;
+  if (containerMode && keyOffset < KEY_ID_LENGTH) {
+    fprintf(stderr, "The first %d characters of the key identify it in a container, so --key-offset has to be at least "
+                    "%d with --container.\n", KEY_ID_LENGTH, KEY_ID_LENGTH);
     exit(2);
   }
 
   /* Open the specified plaintext and key files, checking for existence and setting the length of each file in
    * bytes so we can verify the key we'll send to the daemon is long enough to encrypt the plaintext message. */
-  plaintextFD = open(argv[1], O_RDONLY);
+  plaintextFD = open(argv[optind], O_RDONLY);
   if (plaintextFD < 0)
     error("Could not open the specified plaintext file");
   /* Set the length of the provided plaintext equal to the size of the file
    * (source: https://stackoverflow.com/questions/174531/how-to-read-the-content-of-a-file-to-a-string-in-c). */
-  plaintextLength = lseek(plaintextFD, 0, SEEK_END);
+  plaintextLength = fileLength(&plaintextFD);
 
   // Repeat the above steps for our key to get its size.
-  keyFD = open(argv[2], O_RDONLY);
+  keyFD = open(argv[optind + 1], O_RDONLY);
   if (keyFD < 0)
     error("Could not open the specified key file");
-  keyLength = lseek(keyFD, 0, SEEK_END);
+  keyLength = fileLength(&keyFD);
 
-  // Print an error message and exit if the key is too short to use.
-  if (keyLength < plaintextLength) {
+  /* Map the message and key into memory. The message sent to the daemons ends at the newline that terminates the
+   * plaintext file, and the newline that terminates the key file isn't part of the pad either. */
+  plaintext = mapFile(&plaintextFD, &plaintextLength);
+  key = mapFile(&keyFD, &keyLength);
+  close(plaintextFD);
+  close(keyFD);
+  messageLength = plaintextLength;
+  if (messageLength > 0 && plaintext[messageLength - 1] == '\n')
+    messageLength--;
+  if (keyLength > 0 && key[keyLength - 1] == '\n')
+    keyLength--;
+
+  /* Print an error message and exit if the key is too short to use. With --key-offset, the key is used from that
+   * many characters in, so one key file can be used for several messages. */
+  if (keyOffset > keyLength || keyLength - keyOffset < messageLength) {
     fprintf(stderr, "The provided key does not meet the minimum length requirements to "
-                    "encrypt your message.\nPlease provide a key with a length of %d or more.\n", plaintextLength - 1);
-    close(plaintextFD);
-    close(keyFD);
+                    "encrypt your message.\nPlease provide a key with a length of %zu or more.\n",
+                    keyOffset + messageLength);
     exit(1);
   }
 
-  /* Store the message in our buffer, then pass the buffer to isValidString to make sure that the message has
-   * characters that can be encrypted */
-  memset(buffer, '\0', sizeof(buffer));
-  fileToBuffer(&plaintextFD, buffer, &plaintextLength);
-  validText = isValidString(buffer);
-
-  /* Store the key in our buffer, then pass the buffer to isValidString to make sure that the message has
- * characters that can be used to encrypt our message */
-  memset(buffer, '\0', sizeof(buffer));
-  fileToBuffer(&keyFD, buffer, &keyLength);
-  validKey = isValidString(buffer);
+  /* Pass the message and key to isValidString to make sure that the message has characters that can be encrypted
+   * and the key has characters that can be used to encrypt our message. */
+  validText = isValidString(plaintext, plaintextLength);
+  validKey = isValidString(key + keyOffset, keyLength - keyOffset);
 
   // Print an error message and exit before attempting to connect if either the message or key were invalid
   if (!validText || !validKey) {
     fprintf(stderr, "One or more invalid characters were detected.\n");
-    close(plaintextFD);
-    close(keyFD);
     exit(1);
   }
 
+  // The container's header goes out before any of the ciphertext, which is then indexed as it's written
+  if (containerMode)
+    startContainer(key, keyLength, keyOffset, messageLength);
+  key += keyOffset;
+
+  // Skip the daemons entirely and write the result as it's encrypted, if they're not needed
+  if (localMode) {
+    encryptLocally(plaintext, key, messageLength);
+    if (containerMode)
+      finishContainer();
+    return(0);
+  }
+
+  endpointCount = parseEndpoints(argv[optind + 2], &endpoints);
+  if (endpointCount < 1) {
+    fprintf(stderr, "An error occurred defining a server address.\n");
+    exit(2);
+  }
+
+  // Shared memory only reaches daemons on this host
+  for (int i = 0; i < endpointCount && sharedMemoryMode; i++) {
+    if (strcmp(endpoints[i].host, "localhost") != 0 && strcmp(endpoints[i].host, "127.0.0.1") != 0) {
+      fprintf(stderr, "--shm can only be used with daemons on this host.\n");
+      exit(2);
+    }
+  }
+
+  /* Stripe children write their part of the ciphertext straight into a shared mapping, so the output can be
+   * written to stdout in order as it arrives. */
+  ciphertext = mmap(NULL, messageLength + 1, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (ciphertext == MAP_FAILED)
+    error("An error occurred allocating the output buffer");
+
+  exitStatus = encryptStripes(endpoints, endpointCount, plaintext, key, ciphertext, messageLength);
+
+  // Finish the encrypted result on stdout with a newline, followed by the container's index
+  if (exitStatus == 0) {
+    fprintf(stdout, "\n");
+    if (containerMode)
+      finishContainer();
+  }
+
+  free(endpoints);
+  return(exitStatus);
+}
+
+/* Takes a string, the string's message length, and a key, then translates the ASCII value of each character
+ * into a number between 0 and 26. The message character's value is added to the key character's value
+ * then modular arithmetic is used to encrypt the result. Finally, we translate each encrypted character into an
+ * ASCII value and add a null terminator to the end of the string. This is the same transform otp_enc_d uses. */
+void encrypt(char message[], const unsigned long messageLength, const char key[]) {
+  int plaintextValue = -1, keyValue = -1, encryptedValue = -1;
+
+  for (size_t i = 0; i < messageLength; i++) {
+    /* Adjust spaces to equal the last value in our range, 26, so we can properly calculate the encrypted value with
+     * modular arithmetic. */
+    if ((int) message[i] == 32)
+      plaintextValue = 26;
+    else
+      plaintextValue = (int) (message[i] - 65);
+
+    if ((int) key[i] == 32)
+      keyValue = 26;
+    else
+      keyValue = (int) (key[i] - 65);
+
+    encryptedValue = (plaintextValue + keyValue) % 27;
+
+    if (encryptedValue == 26)
+      message[i] = (char) 32;
+    else
+      message[i] = (char) (encryptedValue + 65);
+  }
+  message[messageLength] = '\0';
+}
+
+/* Takes the mapped message and key and the length of the message, then encrypts the message one chunk at a time in a
+ * small buffer, writing each chunk to stdout as soon as it's done. The output matches what the daemons produce. */
+void encryptLocally(const char message[], const char key[], size_t messageLength) {
+  char buffer[LOCAL_CHUNK_SIZE + 1];
+  size_t chunkLength = 0;
+
+  for (size_t offset = 0; offset < messageLength; offset += chunkLength) {
+    chunkLength = messageLength - offset < LOCAL_CHUNK_SIZE ? messageLength - offset : LOCAL_CHUNK_SIZE;
+    memcpy(buffer, message + offset, chunkLength);
+    encrypt(buffer, chunkLength, key + offset);
+    writeOutput(buffer, chunkLength);
+  }
+
+  // Output the trailing newline the daemon path prints after the encrypted message
+  fprintf(stdout, "\n");
+}
+
+// Error function used for reporting issues
+void error(const char* msg) {
+  perror(msg);
+  exit(2);
+}
+
+/* Takes a file descriptor pointer and a pointer to the length of the file, then maps the whole file read-only so
+ * stripes of any size can be sliced out of it without copying. Pages are only read when they're used. Empty files
+ * map to an empty string. */
+char* mapFile(const int* fileDescriptor, const size_t* fileLength) {
+  char* contents = NULL;
+
+  if (*fileLength == 0)
+    return("");
+
+  contents = mmap(NULL, *fileLength, PROT_READ, MAP_PRIVATE, *fileDescriptor, 0);
+  if (contents == MAP_FAILED)
+    error("An error occurred trying to read file contents");
+
+  return(contents);
+}
+
+// Takes a file descriptor pointer, then returns the size of the file in bytes, exiting with an error if it has none
+size_t fileLength(const int* fileDescriptor) {
+  off_t length = lseek(*fileDescriptor, 0, SEEK_END);
+
+  if (length < 0)
+    error("An error occurred finding the length of a file");
+
+  return((size_t) length);
+}
+
+/* Takes a comma separated list of endpoints, each either a port number or a host and port number separated by a
+ * colon, and stores them in a newly allocated array. Returns the number of endpoints, or -1 if any were invalid. */
+int parseEndpoints(const char list[], struct endpoint** endpoints) {
+  int endpointCount = 1, index = 0;
+  const char* start = list;
+
+  for (size_t i = 0; i < strlen(list); i++) {
+    if (list[i] == ',')
+      endpointCount++;
+  }
+
+  *endpoints = malloc(endpointCount * sizeof(struct endpoint));
+  memset(*endpoints, '\0', endpointCount * sizeof(struct endpoint));
+
+  while (index < endpointCount) {
+    size_t length = strcspn(start, ",");
+    const char* colon = memchr(start, ':', length);
+    const char* port = start;
+
+    // Default to localhost when only a port number was provided, as the clients always have
+    if (colon == NULL) {
+      strcpy((*endpoints)[index].host, "localhost");
+    } else {
+      if (colon == start || colon - start >= sizeof((*endpoints)[index].host))
+        return(-1);
+      memcpy((*endpoints)[index].host, start, colon - start);
+      port = colon + 1;
+    }
+
+    (*endpoints)[index].portNumber = atoi(port); // Get the port number, convert to an integer from a string
+    if ((*endpoints)[index].portNumber <= 0)
+      return(-1);
+
+    start += length + 1;
+    index++;
+  }
+
+  return(endpointCount);
+}
+
+/* Takes an endpoint, resolves its host name and connects a new socket to it, exiting with an error if any step
+ * fails. With --shm, the daemon's Unix socket for the endpoint's port is connected to instead. Only called from
+ * stripe children, so exiting hands the stripe back to the parent to retry elsewhere. */
+int connectToEndpoint(const struct endpoint* target) {
+  int socketFD, noDelay = 1;
+  struct sockaddr_in serverAddress;
+  struct sockaddr_un localAddress;
+  struct hostent* serverHostInfo;
+
+  if (sharedMemoryMode) {
+    memset((char*) &localAddress, '\0', sizeof(localAddress));
+    localAddress.sun_family = AF_UNIX;
+    snprintf(localAddress.sun_path, sizeof(localAddress.sun_path), LOCAL_SOCKET_FORMAT, target->portNumber);
+
+    socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFD < 0)
+      error("An error occurred creating a socket");
+    if (connect(socketFD, (struct sockaddr*) &localAddress, sizeof(localAddress)) < 0)
+      error("An error occurred connecting to the server");
+
+    return(socketFD);
+  }
+
   // Set up the server address struct
   memset((char*) &serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
-  portNumber = atoi(argv[3]); // Get the port number, convert to an integer from a string
   serverAddress.sin_family = AF_INET; // Create a network-capable socket
-  serverAddress.sin_port = htons(portNumber); // Store the port number
-  serverHostInfo = gethostbyname("localhost"); // Convert the machine name into a special form of address
+  serverAddress.sin_port = htons(target->portNumber); // Store the port number
+  serverHostInfo = gethostbyname(target->host); // Convert the machine name into a special form of address
 
   if (serverHostInfo == NULL) {
     fprintf(stderr, "An error occurred defining a server address.\n");
@@ -98,6 +446,166 @@ int main(int argc, char *argv[]) {
   if (connect(socketFD, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) < 0) // Connect socket to address
     error("An error occurred connecting to the server");
 
+  // Send the request header and small requests right away instead of waiting for the handshake to be acknowledged
+  setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+  return(socketFD);
+}
+
+/* Takes the list of endpoints, the mapped message and key, the shared output buffer and the message length, then
+ * splits the message into offset-aligned stripes so that message character i is always encrypted with key
+ * character i. Up to one stripe per endpoint runs at a time, each in its own child process. Children record how much
+ * of their stripe has arrived as they go, and the in-order prefix of the output is written to stdout as soon as it's
+ * complete. A stripe that fails is resumed from where it stopped on the next endpoint in the list, until every
+ * endpoint has been tried. Returns the exit status to use. */
+int encryptStripes(const struct endpoint* endpoints, int endpointCount, const char message[], const char key[], char output[], size_t messageLength) {
+  int stripeCount = 1, nextStripe = 0, running = 0, completed = 0, flushedStripe = 0;
+  int exitMethod = -5;
+  size_t stripeSize = messageLength, flushed = 0, released = 0;
+  struct stripe* stripes = NULL;
+  struct sigaction notifyAction;
+  struct pollfd notification;
+  char drain[64];
+  pid_t finishedPid = -5;
+
+  // Use one stripe per endpoint, unless that would make stripes too small to be worth a connection
+  if (messageLength > MIN_STRIPE_SIZE)
+    stripeCount = (messageLength + MIN_STRIPE_SIZE - 1) / MIN_STRIPE_SIZE;
+  if (stripeCount > endpointCount)
+    stripeCount = endpointCount;
+  if (stripeCount > 1)
+    stripeSize = (messageLength + stripeCount - 1) / stripeCount;
+
+  // The stripes are shared with the children so the parent can see how far along each of them is
+  stripes = mmap(NULL, stripeCount * sizeof(struct stripe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stripes == MAP_FAILED)
+    error("An error occurred allocating the stripes");
+  for (int i = 0; i < stripeCount; i++) {
+    stripes[i].offset = i * stripeSize;
+    stripes[i].length = (i == stripeCount - 1) ? messageLength - stripes[i].offset : stripeSize;
+    stripes[i].progress = 0;
+    stripes[i].endpointIndex = i % endpointCount;
+    stripes[i].attempts = 0;
+    stripes[i].pid = -5;
+  }
+
+  /* Children write a byte to this pipe whenever more of their stripe has arrived, and the SIGCHLD handler writes one
+   * whenever a child exits, so the parent can sleep in poll until there's either output to write or a stripe to
+   * reap. Both ends are non-blocking so nobody ever waits on a full pipe. */
+  if (pipe(notifyPipe) < 0)
+    error("An error occurred creating a pipe");
+  fcntl(notifyPipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(notifyPipe[1], F_SETFL, O_NONBLOCK);
+  memset(&notifyAction, '\0', sizeof(notifyAction));
+  notifyAction.sa_handler = notifyParent;
+  notifyAction.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &notifyAction, NULL);
+  notification.fd = notifyPipe[0];
+  notification.events = POLLIN;
+
+  while (completed < stripeCount) {
+    // Start new stripes until every endpoint has one in flight
+    while (running < endpointCount && nextStripe < stripeCount) {
+      launchStripe(&stripes[nextStripe], endpoints, message, key, output);
+      nextStripe++;
+      running++;
+    }
+
+    if (poll(&notification, 1, -1) < 0 && errno != EINTR)
+      error("An error occurred waiting for a stripe");
+    while (read(notifyPipe[0], drain, sizeof(drain)) > 0);
+
+    while ((finishedPid = waitpid(-1, &exitMethod, WNOHANG)) > 0) {
+      for (int i = 0; i < stripeCount; i++) {
+        if (stripes[i].pid != finishedPid)
+          continue;
+
+        stripes[i].pid = -5;
+        running--;
+
+        if (WIFEXITED(exitMethod) && WEXITSTATUS(exitMethod) == 0) {
+          completed++;
+        } else if (++stripes[i].attempts < endpointCount) {
+          // Hand what's left of the failed stripe to the next endpoint, alongside whatever it's already doing
+          stripes[i].endpointIndex = (stripes[i].endpointIndex + 1) % endpointCount;
+          launchStripe(&stripes[i], endpoints, message, key, output);
+          running++;
+        } else {
+          // Every endpoint has failed this stripe, so stop the remaining stripes and give up
+          for (int j = 0; j < stripeCount; j++) {
+            if (stripes[j].pid > 0)
+              kill(stripes[j].pid, SIGTERM);
+          }
+          while (wait(NULL) > 0);
+          munmap(stripes, stripeCount * sizeof(struct stripe));
+          return(WIFEXITED(exitMethod) ? WEXITSTATUS(exitMethod) : 2);
+        }
+        break;
+      }
+    }
+
+    // Write out everything that's arrived in order so far
+    while (flushedStripe < stripeCount) {
+      size_t progress = __atomic_load_n(&stripes[flushedStripe].progress, __ATOMIC_ACQUIRE);
+      size_t end = stripes[flushedStripe].offset + progress;
+
+      if (end > flushed) {
+        writeOutput(output + flushed, end - flushed);
+        fflush(stdout);
+        flushed = end;
+      }
+      if (progress < stripes[flushedStripe].length)
+        break;
+      flushedStripe++;
+    }
+
+    // Give the pages that have been written back to the system, so large jobs don't hold their whole output
+    if (flushed - released >= RELEASE_SIZE) {
+      size_t releaseEnd = flushed / RELEASE_SIZE * RELEASE_SIZE;
+      madvise(output + released, releaseEnd - released, MADV_REMOVE);
+      released = releaseEnd;
+    }
+  }
+
+  munmap(stripes, stripeCount * sizeof(struct stripe));
+  return(0);
+}
+
+// Signal handler that wakes the parent's poll when a stripe child exits
+void notifyParent(int signalNumber) {
+  int savedErrno = errno;
+  write(notifyPipe[1], "", 1);
+  errno = savedErrno;
+}
+
+/* Takes a stripe, the list of endpoints, the mapped message and key, and the shared output buffer, then forks a
+ * child process that sends the stripe to its current endpoint and exits with the stripe's result. Only the parent
+ * records the process ID, since the stripe is shared and the child would otherwise overwrite it with 0. */
+void launchStripe(struct stripe* job, const struct endpoint* endpoints, const char message[], const char key[], char output[]) {
+  pid_t spawnPid = fork();
+
+  switch (spawnPid) {
+    case -1:
+      error("An error occurred creating a process to send a stripe");
+    case 0:
+      signal(SIGCHLD, SIG_DFL);
+      exit(runStripe(&endpoints[job->endpointIndex], message, key, output, job));
+    default:
+      job->pid = spawnPid;
+      break;
+  }
+}
+
+/* Takes an endpoint, connects to it and performs the usual handshake, making sure the daemon is otp_enc_d.
+ * Returns the connected socket, or -1 if a different program answered. */
+int openSession(const struct endpoint* target) {
+  int socketFD, messageFragmentSize = 10;
+  char buffer[256], messageFragment[messageFragmentSize];
+  char connectionValidator[] = ">>";
+  char endOfMessage[] = "||";
+
+  socketFD = connectToEndpoint(target);
+
   // Send message to server
   sendStringToSocket(&socketFD, ">>||");
 
@@ -108,66 +616,481 @@ int main(int argc, char *argv[]) {
   if (strcmp(buffer, connectionValidator) != 0) {
     // Close the socket and clean up since the message received suggests this wasn't the right daemon
     close(socketFD);
-    // Close file descriptors
-    close(plaintextFD);
-    close(keyFD);
     fprintf(stderr, "A connection was made to an unknown destination.\n");
+    return(-1);
+  }
+
+  return(socketFD);
+}
+
+/* Takes an endpoint, the mapped message and key, the shared output buffer and a stripe, then asks the daemon to
+ * stream back (or encrypt in shared memory, with --shm) whatever part of the stripe hasn't arrived yet. A daemon
+ * that's too busy for a bulk request right now is asked again after a growing delay. Returns 0 once the whole stripe
+ * has been encrypted, or 2 if the stripe should be retried elsewhere. */
+int runStripe(const struct endpoint* target, const char message[], const char key[], char output[], struct stripe* job) {
+  int socketFD, result = -5, busyRetries = 0;
+  char header[128];
+  size_t resumeFrom = job->progress, offset = job->offset + job->progress;
+  useconds_t backoff = 50000;
+
+  while (1) {
+    socketFD = openSession(target);
+    if (socketFD < 0)
+      return(2);
+
+    if (generateMode) {
+      // Ask for the rest of the stripe to be encrypted with a key the daemon generates, and kept there if it was named
+      if (storedKeyName != NULL)
+        snprintf(header, sizeof(header), "#G %zu %d %s\n", job->length - resumeFrom, STREAM_CHUNK_SIZE, storedKeyName);
+      else
+        snprintf(header, sizeof(header), "#G %zu %d\n", job->length - resumeFrom, STREAM_CHUNK_SIZE);
+      sendStringToSocket(&socketFD, header);
+      result = generateStripe(&socketFD, message + offset, generatedKey != NULL ? generatedKey + offset : NULL,
+                              output + offset, job->length - resumeFrom, job);
+    } else if (sharedMemoryMode) {
+      result = ringStripe(&socketFD, message + offset, key + offset, output + offset, job->length - resumeFrom, job);
+    } else {
+      // Ask for the rest of the stripe to be streamed back, one chunk at a time
+      snprintf(header, sizeof(header), "#S %zu %d\n", job->length - resumeFrom, STREAM_CHUNK_SIZE);
+      sendStringToSocket(&socketFD, header);
+      result = streamStripe(&socketFD, message + offset, key + offset, output + offset, job->length - resumeFrom, job);
+    }
+    close(socketFD); // Close the socket
+
+    if (result != -2 || ++busyRetries >= BUSY_RETRY_LIMIT)
+      break;
+    usleep(backoff);
+    backoff = backoff * 2 < BUSY_BACKOFF_MAX_US ? backoff * 2 : BUSY_BACKOFF_MAX_US;
+  }
+
+  // A daemon that turned the request down has already had its reason printed
+  if (result == -3)
+    return(2);
+  if (result < 0) {
+    fprintf(stderr, "An incomplete response was received from %s:%d.\n", target->host, target->portNumber);
+    return(2);
+  }
+
+  return(0);
+}
+
+/* Takes a connected socket that a stream request has just been sent on, the message and key to send, where the
+ * encrypted message belongs in the shared output buffer, the number of characters to send and the stripe they belong
+ * to. The message and key are sent interleaved, one chunk of each at a time, while the daemon's status line and then
+ * the encrypted chunks are read back as they arrive. Sending and receiving happen together, so the daemon is never
+ * left waiting on a client that's still busy sending. Returns 0 once everything has arrived, -2 if the daemon was
+ * too busy to take the request, -3 if it turned the request down, or -1 on any other failure. */
+int streamStripe(const int* socketFD, const char message[], const char key[], char output[], size_t length, struct stripe* job) {
+  struct pollfd connection;
+  char status[128];
+  size_t sent = 0, received = 0, statusLength = 0, streamLength = 2 * length;
+  size_t resumeFrom = job->progress;
+  int statusDone = 0;
+  ssize_t charsMoved = -5;
+
+  fcntl(*socketFD, F_SETFL, O_NONBLOCK);
+  connection.fd = *socketFD;
+
+  while (!statusDone || received < length) {
+    connection.events = POLLIN | (sent < streamLength ? POLLOUT : 0);
+    if (poll(&connection, 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return(-1);
+    }
+
+    if (connection.revents & POLLOUT) {
+      // Work out which chunk, and whether its message or key half, the next byte in the stream comes from
+      size_t chunkStart = sent / (2 * STREAM_CHUNK_SIZE) * STREAM_CHUNK_SIZE;
+      size_t chunkLength = length - chunkStart < STREAM_CHUNK_SIZE ? length - chunkStart : STREAM_CHUNK_SIZE;
+      size_t withinChunk = sent - 2 * chunkStart;
+
+      if (withinChunk < chunkLength)
+        charsMoved = send(*socketFD, message + chunkStart + withinChunk, chunkLength - withinChunk, 0);
+      else
+        charsMoved = send(*socketFD, key + chunkStart + withinChunk - chunkLength, 2 * chunkLength - withinChunk, 0);
+
+      if (charsMoved < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return(-1);
+      if (charsMoved > 0)
+        sent += charsMoved;
+    }
+
+    if (connection.revents & (POLLIN | POLLHUP | POLLERR)) {
+      // The daemon's status line comes first, read a character at a time so none of the output is read with it
+      if (!statusDone)
+        charsMoved = recv(*socketFD, status + statusLength, 1, 0);
+      else
+        charsMoved = recv(*socketFD, output + received, length - received, 0);
+
+      if (charsMoved == 0 || (charsMoved < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        return(-1);
+      if (charsMoved < 0)
+        continue;
+
+      if (!statusDone) {
+        statusLength += charsMoved;
+        if (status[statusLength - 1] == '\n' || statusLength == sizeof(status) - 1) {
+          status[statusLength] = '\0';
+          if (status[0] == '~')
+            return(-2);
+          if (status[0] != '+') {
+            fprintf(stderr, "%s", status + 1);
+            return(-3);
+          }
+          statusDone = 1;
+        }
+      } else {
+        // Record how much of the stripe has arrived, and let the parent know so it can write it out
+        received += charsMoved;
+        __atomic_store_n(&job->progress, resumeFrom + received, __ATOMIC_RELEASE);
+        write(notifyPipe[1], "", 1);
+      }
+    }
+  }
+
+  return(0);
+}
+
+/* Takes the path of the plaintext file, the list of endpoints and the path to write the generated key to (NULL when
+ * the key is kept in the daemon's pad store), then encrypts the plaintext with a key the daemons generate as they go.
+ * The key file has to be new. It's mapped so each stripe's part of the key is written straight into it, and it's
+ * removed again if the message couldn't be encrypted. Returns the exit status to use. */
+int encryptWithGeneratedKey(const char plaintextPath[], const char endpointList[], const char keyPath[]) {
+  int plaintextFD, keyFD, endpointCount = 0, exitStatus = 0;
+  size_t plaintextLength = 0, messageLength = 0;
+  char* plaintext = NULL;
+  char* ciphertext = NULL;
+  struct endpoint* endpoints = NULL;
+
+  plaintextFD = open(plaintextPath, O_RDONLY);
+  if (plaintextFD < 0)
+    error("Could not open the specified plaintext file");
+  plaintextLength = fileLength(&plaintextFD);
+  plaintext = mapFile(&plaintextFD, &plaintextLength);
+  close(plaintextFD);
+
+  if (!isValidString(plaintext, plaintextLength)) {
+    fprintf(stderr, "One or more invalid characters were detected.\n");
+    exit(1);
+  }
+  messageLength = plaintextLength;
+  if (messageLength > 0 && plaintext[messageLength - 1] == '\n')
+    messageLength--;
+
+  endpointCount = parseEndpoints(endpointList, &endpoints);
+  if (endpointCount < 1) {
+    fprintf(stderr, "An error occurred defining a server address.\n");
     exit(2);
-  } else {
-    // Send the message by storing it in the cleared buffer, closing the file descriptor and sending it through the socket
-    memset(buffer, '\0', sizeof(buffer));
-    fileToBuffer(&plaintextFD, buffer, &plaintextLength);
-    close(plaintextFD);
-    sendStringToSocket(&socketFD, buffer);
-
-    // Send the key by storing it in the cleared buffer, closing the file descriptor and sending it through the socket
-    memset(buffer, '\0', sizeof(buffer));
-    fileToBuffer(&keyFD, buffer, &keyLength);
+  }
+  // A stored key has to be kept whole by one daemon
+  if (storedKeyName != NULL && endpointCount > 1) {
+    fprintf(stderr, "A stored key can only be generated by a single daemon.\n");
+    exit(2);
+  }
+
+  /* The key ends with a newline like keygen's. An existing key file is never replaced, since whatever was encrypted
+   * with it couldn't be decrypted any more, so the file is always one this run created. */
+  if (keyPath != NULL) {
+    keyFD = open(keyPath, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (keyFD < 0 && errno == EEXIST) {
+      fprintf(stderr, "The key file %s already exists.\n", keyPath);
+      exit(1);
+    }
+    if (keyFD < 0)
+      error("Could not create the specified key file");
+    if (ftruncate(keyFD, messageLength + 1) < 0) {
+      unlink(keyPath);
+      error("An error occurred sizing the key file");
+    }
+    generatedKey = mmap(NULL, messageLength + 1, PROT_READ | PROT_WRITE, MAP_SHARED, keyFD, 0);
+    if (generatedKey == MAP_FAILED) {
+      unlink(keyPath);
+      error("An error occurred mapping the key file");
+    }
     close(keyFD);
-    sendStringToSocket(&socketFD, buffer);
+    generatedKey[messageLength] = '\n';
+  }
 
-    // Indicate to the server that both the plaintext and key have been sent
-    sendStringToSocket(&socketFD, endOfMessage);
+  ciphertext = mmap(NULL, messageLength + 1, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (ciphertext == MAP_FAILED)
+    error("An error occurred allocating the output buffer");
 
-    // Get return message from server
-    memset(buffer, '\0', sizeof(buffer)); // Clear out the buffer again for reuse
-    receiveStringFromSocket(&socketFD, buffer, messageFragment, &messageFragmentSize, endOfMessage);
+  exitStatus = encryptStripes(endpoints, endpointCount, plaintext, NULL, ciphertext, messageLength);
+  if (exitStatus == 0)
+    fprintf(stdout, "\n");
 
-    // Output the decrypted result to stdout
-    fprintf(stdout, "%s\n", buffer);
+  if (keyPath != NULL) {
+    munmap(generatedKey, messageLength + 1);
+    if (exitStatus != 0)
+      unlink(keyPath);
   }
+  free(endpoints);
+  return(exitStatus);
+}
 
-  close(socketFD); // Close the socket
+/* Takes a connected socket that a generate request has just been sent on, the message to send, where the stripe's
+ * part of the generated key belongs (NULL if the daemon keeps it), where the encrypted message belongs in the shared
+ * output buffer, the number of characters to send and the stripe they belong to. Once the daemon accepts the request,
+ * the message is sent while the encrypted chunks are read back, each followed by its chunk of key unless the daemon
+ * keeps the key. Characters only count as arrived once their key has too, so a resumed stripe leaves no gap in the
+ * key. Returns 0 once everything has arrived, -2 if the daemon was too busy to take the request, -3 if it turned the
+ * request down, or -1 on any other failure. */
+int generateStripe(const int* socketFD, const char message[], char key[], char output[], size_t length, struct stripe* job) {
+  struct pollfd connection;
+  size_t sent = 0, received = 0, responseLength = key != NULL ? 2 * length : length;
+  size_t resumeFrom = job->progress, chunkStart = 0, chunkLength = 0, withinChunk = 0;
+  ssize_t charsMoved = -5;
+  int result = receiveStatusLine(socketFD);
+
+  if (result != 0)
+    return(result);
+
+  fcntl(*socketFD, F_SETFL, O_NONBLOCK);
+  connection.fd = *socketFD;
+
+  while (received < responseLength) {
+    connection.events = POLLIN | (sent < length ? POLLOUT : 0);
+    if (poll(&connection, 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return(-1);
+    }
+
+    if (connection.revents & POLLOUT) {
+      charsMoved = send(*socketFD, message + sent, length - sent, 0);
+      if (charsMoved < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return(-1);
+      if (charsMoved > 0)
+        sent += charsMoved;
+    }
+
+    if (connection.revents & (POLLIN | POLLHUP | POLLERR)) {
+      // Work out which chunk, and whether its ciphertext or key half, the next byte in the response belongs to
+      if (key == NULL) {
+        charsMoved = recv(*socketFD, output + received, length - received, 0);
+      } else {
+        chunkStart = received / (2 * STREAM_CHUNK_SIZE) * STREAM_CHUNK_SIZE;
+        chunkLength = length - chunkStart < STREAM_CHUNK_SIZE ? length - chunkStart : STREAM_CHUNK_SIZE;
+        withinChunk = received - 2 * chunkStart;
+        if (withinChunk < chunkLength)
+          charsMoved = recv(*socketFD, output + chunkStart + withinChunk, chunkLength - withinChunk, 0);
+        else
+          charsMoved = recv(*socketFD, key + chunkStart + withinChunk - chunkLength, 2 * chunkLength - withinChunk, 0);
+      }
+
+      if (charsMoved == 0 || (charsMoved < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        return(-1);
+      if (charsMoved < 0)
+        continue;
+      received += charsMoved;
+
+      // Record how much of the stripe (and its key) has arrived, and let the parent know so it can write it out
+      if (key != NULL) {
+        chunkStart = received / (2 * STREAM_CHUNK_SIZE) * STREAM_CHUNK_SIZE;
+        chunkLength = length - chunkStart < STREAM_CHUNK_SIZE ? length - chunkStart : STREAM_CHUNK_SIZE;
+        withinChunk = received - 2 * chunkStart;
+        __atomic_store_n(&job->progress, resumeFrom + chunkStart + (withinChunk > chunkLength ? withinChunk - chunkLength : 0),
+                         __ATOMIC_RELEASE);
+      } else {
+        __atomic_store_n(&job->progress, resumeFrom + received, __ATOMIC_RELEASE);
+      }
+      write(notifyPipe[1], "", 1);
+    }
+  }
 
   return(0);
 }
 
-// Error function used for reporting issues
-void error(const char* msg) {
-  perror(msg);
-  exit(2);
+/* Takes a socket connected to a daemon's Unix socket, the message and key to send, where the encrypted message
+ * belongs in the shared output buffer, the number of characters to send and the stripe they belong to. A ring of
+ * shared memory and two event counters are created and handed to the daemon once it accepts the request. Slots are
+ * filled with a chunk of message followed by the same length of key, and the daemon encrypts each slot's message in
+ * place. Filling and collecting happen together, so the ring is refilled as soon as slots have been collected.
+ * Returns 0 once everything has arrived, -2 if the daemon was too busy to take the request, -3 if it turned the
+ * request down, or -1 on any other failure. */
+int ringStripe(const int* socketFD, const char message[], const char key[], char output[], size_t length, struct stripe* job) {
+  size_t ringSize = RING_HEADER_SIZE + RING_SLOT_COUNT * 2 * STREAM_CHUNK_SIZE;
+  size_t chunkCount = (length + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE, produced = 0, collected = 0;
+  size_t resumeFrom = job->progress, chunkStart = 0, chunkLength = 0;
+  int ringFDs[RING_DESCRIPTOR_COUNT] = {-1, -1, -1};
+  int result = -1;
+  char header[64];
+  char* ring = MAP_FAILED;
+  char* slot = NULL;
+  struct ringHeader* positions = NULL;
+  unsigned long long filled = 1;
+
+  // The ring lives in an anonymous file so it can be passed to the daemon, with counters for each side to wake the
+  // other. The file is sealed against shrinking once it's sized, so the daemon knows its mapping can't be cut short
+  // later.
+  ringFDs[0] = syscall(SYS_memfd_create, "otp ring", MFD_ALLOW_SEALING);
+  ringFDs[1] = eventfd(0, 0);
+  ringFDs[2] = eventfd(0, 0);
+  if (ringFDs[0] >= 0 && ftruncate(ringFDs[0], ringSize) == 0 && fcntl(ringFDs[0], F_ADD_SEALS, F_SEAL_SHRINK) == 0)
+    ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, ringFDs[0], 0);
+
+  if (ring != MAP_FAILED && ringFDs[1] >= 0 && ringFDs[2] >= 0) {
+    positions = (struct ringHeader*) ring;
+    snprintf(header, sizeof(header), "#R %zu %d %d\n", length, RING_SLOT_COUNT, STREAM_CHUNK_SIZE);
+    sendStringToSocket(socketFD, header);
+    result = receiveStatusLine(socketFD);
+    if (result == 0 && sendDescriptors(socketFD, ringFDs, RING_DESCRIPTOR_COUNT) < 0)
+      result = -1;
+  } else {
+    fprintf(stderr, "An error occurred creating a shared memory ring.\n");
+  }
+
+  while (result == 0 && collected < chunkCount) {
+    // Fill every slot that's free, then wake the daemon once for all of them
+    if (produced < chunkCount && produced - collected < RING_SLOT_COUNT) {
+      while (produced < chunkCount && produced - collected < RING_SLOT_COUNT) {
+        chunkStart = produced * STREAM_CHUNK_SIZE;
+        chunkLength = length - chunkStart < STREAM_CHUNK_SIZE ? length - chunkStart : STREAM_CHUNK_SIZE;
+        slot = ring + RING_HEADER_SIZE + (produced % RING_SLOT_COUNT) * 2 * STREAM_CHUNK_SIZE;
+        memcpy(slot, message + chunkStart, chunkLength);
+        memcpy(slot + STREAM_CHUNK_SIZE, key + chunkStart, chunkLength);
+        produced++;
+      }
+      __atomic_store_n(&positions->produced, produced, __ATOMIC_RELEASE);
+      write(ringFDs[1], &filled, sizeof(filled));
+    }
+
+    /* Collect whatever the daemon has encrypted, or wait for it if there's nothing yet. The daemon closes the socket
+     * as soon as it's encrypted the last slot, so that slot is checked for again before giving up. */
+    if (collected == __atomic_load_n(&positions->consumed, __ATOMIC_ACQUIRE)) {
+      if (waitForRing(socketFD, ringFDs[2]) < 0 && collected == __atomic_load_n(&positions->consumed, __ATOMIC_ACQUIRE))
+        result = -1;
+      continue;
+    }
+    while (collected < __atomic_load_n(&positions->consumed, __ATOMIC_ACQUIRE)) {
+      chunkStart = collected * STREAM_CHUNK_SIZE;
+      chunkLength = length - chunkStart < STREAM_CHUNK_SIZE ? length - chunkStart : STREAM_CHUNK_SIZE;
+      slot = ring + RING_HEADER_SIZE + (collected % RING_SLOT_COUNT) * 2 * STREAM_CHUNK_SIZE;
+      memcpy(output + chunkStart, slot, chunkLength);
+      collected++;
+    }
+
+    // Record how much of the stripe has arrived, and let the parent know so it can write it out
+    __atomic_store_n(&job->progress, resumeFrom + (collected == chunkCount ? length : collected * STREAM_CHUNK_SIZE),
+                     __ATOMIC_RELEASE);
+    write(notifyPipe[1], "", 1);
+  }
+
+  if (ring != MAP_FAILED)
+    munmap(ring, ringSize);
+  for (int i = 0; i < RING_DESCRIPTOR_COUNT; i++) {
+    if (ringFDs[i] >= 0)
+      close(ringFDs[i]);
+  }
+
+  return(result);
 }
 
-/* Takes a file descriptor pointer, a buffer to store the file's contents and a pointer to the length of the file,
- * then uses the read function to store the provided number of bytes from the file into the buffer. */
-void fileToBuffer(const int* fileDescriptor, char buffer[], const int* fileLength) {
-  int bytesRead = -5;
-  lseek(*fileDescriptor, 0, SEEK_SET);
-  bytesRead = read(*fileDescriptor, buffer, *fileLength);
-  if (bytesRead < 0)
-    error("An error occurred trying to read file contents");
+/* Takes a socket a request has just been sent on, then reads the daemon's status line a character at a time so
+ * nothing after it is read with it. Returns 0 if the request was accepted, -2 if the daemon was too busy for it, -3
+ * (after printing the daemon's reason) if it was turned down, or -1 if the connection ended first. */
+int receiveStatusLine(const int* socketFD) {
+  char status[128];
+  size_t statusLength = 0;
+
+  do {
+    if (recv(*socketFD, status + statusLength, 1, 0) <= 0)
+      return(-1);
+    statusLength++;
+  } while (status[statusLength - 1] != '\n' && statusLength < sizeof(status) - 1);
+  status[statusLength] = '\0';
+
+  if (status[0] == '~')
+    return(-2);
+  if (status[0] != '+') {
+    fprintf(stderr, "%s", status + 1);
+    return(-3);
+  }
+
+  return(0);
+}
+
+/* Takes an endpoint, then asks the daemon there for its metrics with a "#Q" request and copies them to stdout until
+ * the daemon closes the connection. Returns the exit status to use. */
+int printDaemonStats(const struct endpoint* target) {
+  int socketFD = openSession(target);
+  char buffer[4096];
+  ssize_t charsRead = -5;
+
+  if (socketFD < 0)
+    return(2);
+
+  sendStringToSocket(&socketFD, "#Q\n");
+  if (receiveStatusLine(&socketFD) != 0) {
+    close(socketFD);
+    return(2);
+  }
+  while ((charsRead = recv(socketFD, buffer, sizeof(buffer), 0)) > 0)
+    fwrite(buffer, sizeof(char), charsRead, stdout);
+
+  close(socketFD); // Close the socket
+  return(charsRead < 0 ? 2 : 0);
+}
+
+/* Takes a socket connected to a daemon's Unix socket, an array of file descriptors and how many there are, then
+ * passes them to the daemon along with a single byte. Returns 0 on success, or -1 if they couldn't be sent. */
+int sendDescriptors(const int* socketFD, const int descriptors[], int descriptorCount) {
+  char marker = 'R';
+  char control[CMSG_SPACE(RING_DESCRIPTOR_COUNT * sizeof(int))];
+  struct iovec markerVector = {&marker, 1};
+  struct msghdr message;
+  struct cmsghdr* controlMessage = NULL;
+
+  memset(&message, '\0', sizeof(message));
+  memset(control, '\0', sizeof(control));
+  message.msg_iov = &markerVector;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = CMSG_SPACE(descriptorCount * sizeof(int));
+
+  controlMessage = CMSG_FIRSTHDR(&message);
+  controlMessage->cmsg_level = SOL_SOCKET;
+  controlMessage->cmsg_type = SCM_RIGHTS;
+  controlMessage->cmsg_len = CMSG_LEN(descriptorCount * sizeof(int));
+  memcpy(CMSG_DATA(controlMessage), descriptors, descriptorCount * sizeof(int));
+
+  return(sendmsg(*socketFD, &message, 0) == 1 ? 0 : -1);
+}
+
+/* Takes a socket and an event counter, then sleeps until the counter is added to, which is reset on waking. The
+ * socket is watched too, since nothing more is sent on it while a ring is in use, so anything arriving on it means
+ * the other side has gone away. Returns 0 once woken, or -1 if the other side has gone. */
+int waitForRing(const int* socketFD, int eventFD) {
+  struct pollfd watched[2];
+  unsigned long long count = 0;
+
+  watched[0].fd = eventFD;
+  watched[1].fd = *socketFD;
+  watched[0].events = watched[1].events = POLLIN;
+
+  if (poll(watched, 2, -1) < 0)
+    return(errno == EINTR ? 0 : -1);
+  if (watched[1].revents & (POLLIN | POLLHUP | POLLERR))
+    return(-1);
+  if (watched[0].revents & POLLIN)
+    read(eventFD, &count, sizeof(count));
+
+  return(0);
 }
 
 /* Takes a socket, a message buffer, a smaller array to hold characters as they're read, the size of the array, and a
  * small string used by client and server to indicate the end of a message. The function loops through until the
  * substring is found, as seen in the Network Clients video for block 4, repeatedly adding the message fragment
- * to the end of the message. The substring that marks the end of the message is then replaced with a null terminator. */
-void receiveStringFromSocket(const int* establishedConnectionFD, char message[], char messageFragment[], const int* messageFragmentSize, const char endOfMessage[]) {
+ * to the end of the message. The message length is tracked so each fragment is appended and searched without
+ * rescanning the whole message. The substring that marks the end of the message is then replaced with a null
+ * terminator. Returns -1 if the connection ended before the substring was found. */
+int receiveStringFromSocket(const int* establishedConnectionFD, char message[], char messageFragment[], const int* messageFragmentSize, const char endOfMessage[]) {
   int charsRead = -5;
-  long terminalLocation = -5;
+  size_t messageLength = strlen(message), searchFrom = 0;
+  char* terminalLocation = strstr(message, endOfMessage);
 
-  while (strstr(message, endOfMessage) == NULL) {
-    memset(messageFragment, '\0', *messageFragmentSize);
+  while (terminalLocation == NULL) {
     charsRead = recv(*establishedConnectionFD, messageFragment, *messageFragmentSize - 1, 0);
 
     // Exit the loop if we either don't read any more characters when receiving, or we failed to retrieve any characters
@@ -176,28 +1099,31 @@ void receiveStringFromSocket(const int* establishedConnectionFD, char message[],
     if (charsRead == -1)
       break;
 
-    strcat(message, messageFragment);
+    // Only the new characters, and the few before them the substring could start in, need to be searched
+    searchFrom = messageLength >= strlen(endOfMessage) ? messageLength - strlen(endOfMessage) + 1 : 0;
+    memcpy(message + messageLength, messageFragment, charsRead);
+    messageLength += charsRead;
+    message[messageLength] = '\0';
+    terminalLocation = strstr(message + searchFrom, endOfMessage);
   }
 
-  /* Find the terminal location using the method in the Network Clients video from Block 4
-   * then set a null terminator after the actual message contents end. */
-  terminalLocation = strstr(message, endOfMessage) - message;
-  message[terminalLocation] = '\0';
+  if (terminalLocation == NULL)
+    return(-1);
+
+  // Set a null terminator after the actual message contents end
+  *terminalLocation = '\0';
+  return(0);
 }
 
-/* Takes a pointer to a socket, followed by a string to send via that socket,
- * then loops to ensure all the data in the string is sent. */
-void sendStringToSocket(const int* socketFD, const char message[]) {
-  int charsWritten;
-  // Send message to server
-  charsWritten = send(*socketFD, message, strlen(message), 0); // Write to the server
-  if (charsWritten < 0)
-    error("An error occurred writing to the socket");
+/* Takes a pointer to a socket, followed by a buffer and the number of bytes to send from it,
+ * then loops to ensure all the data in the buffer is sent. */
+void sendBytesToSocket(const int* socketFD, const char message[], size_t messageLength) {
+  size_t charsWritten = 0;
 
-  while (charsWritten < strlen(message)) {
+  while (charsWritten < messageLength) {
     int addedChars = 0;
-    // Write to the server again, starting from one character after the most recently sent character
-    addedChars = send(*socketFD, message + charsWritten, strlen(message) - charsWritten, 0);
+    // Write to the server, starting from one character after the most recently sent character
+    addedChars = send(*socketFD, message + charsWritten, messageLength - charsWritten, 0);
     if (addedChars < 0)
       error("An error occurred writing to the socket");
 
@@ -210,11 +1136,17 @@ void sendStringToSocket(const int* socketFD, const char message[]) {
   }
 }
 
-/* Takes a string, then uses a loop starting from the beginning of the string to check one character at a time,
- * ensuring that the character is either a space or uppercase letter. Exits the loop and returns true at the end
- * of the string, or returns false when an invalid character is found that can't be sent to our daemon. */
-int isValidString(const char buffer[]) {
-  for (int i = 0; i < strlen(buffer); i++) {
+/* Takes a pointer to a socket, followed by a string to send via that socket,
+ * then loops to ensure all the data in the string is sent. */
+void sendStringToSocket(const int* socketFD, const char message[]) {
+  sendBytesToSocket(socketFD, message, strlen(message));
+}
+
+/* Takes a buffer and its length, then uses a loop starting from the beginning of the buffer to check one character at
+ * a time, ensuring that the character is either a space or uppercase letter. Exits the loop and returns true at the
+ * end of the buffer, or returns false when an invalid character is found that can't be sent to our daemon. */
+int isValidString(const char buffer[], size_t length) {
+  for (size_t i = 0; i < length; i++) {
     if (!isupper(buffer[i]) && !isspace(buffer[i])) {
       // Return false immediately if any character
       return(0);
@@ -222,3 +1154,61 @@ int isValidString(const char buffer[]) {
   }
   return(1);
 }
+
+/* Takes a hash to continue from, a buffer and its length, then returns the 64-bit FNV-1a hash of the buffer's
+ * contents added to the hash. Starting from FNV_OFFSET_BASIS hashes just the buffer. */
+unsigned long long hashBytes(unsigned long long hash, const char buffer[], size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char) buffer[i];
+    hash *= FNV_PRIME;
+  }
+  return(hash);
+}
+
+/* Takes part of the encrypted message and its length, then writes it to stdout. In a container, each chunk's
+ * checksum is built up as the chunk is written, whatever sizes the pieces it's written in. */
+void writeOutput(const char output[], size_t length) {
+  size_t chunk = 0, chunkRemaining = 0, piece = 0;
+
+  fwrite(output, sizeof(char), length, stdout);
+
+  for (size_t done = 0; containerMode && done < length; done += piece) {
+    chunk = (outputWritten + done) / CONTAINER_CHUNK_SIZE;
+    chunkRemaining = CONTAINER_CHUNK_SIZE - (outputWritten + done) % CONTAINER_CHUNK_SIZE;
+    piece = length - done < chunkRemaining ? length - done : chunkRemaining;
+    chunkChecksums[chunk] = hashBytes(chunkChecksums[chunk], output + done, piece);
+  }
+  outputWritten += length;
+}
+
+/* Takes the mapped key and its length, the offset the message is encrypted from and the message length, then writes
+ * the container's header line and sets up a checksum for each chunk of the encrypted message. */
+void startContainer(const char key[], size_t keyLength, size_t keyOffset, size_t messageLength) {
+  size_t chunkCount = (messageLength + CONTAINER_CHUNK_SIZE - 1) / CONTAINER_CHUNK_SIZE;
+  unsigned long long keyId = hashBytes(FNV_OFFSET_BASIS, key, keyLength < KEY_ID_LENGTH ? keyLength : KEY_ID_LENGTH);
+
+  chunkChecksums = malloc((chunkCount > 0 ? chunkCount : 1) * sizeof(unsigned long long));
+  if (chunkChecksums == NULL)
+    error("An error occurred allocating the container index");
+  for (size_t i = 0; i < chunkCount; i++)
+    chunkChecksums[i] = FNV_OFFSET_BASIS;
+
+  containerHeaderLength = fprintf(stdout, CONTAINER_MAGIC " key-id=%016llx key-offset=%zu length=%zu chunk-size=%d\n",
+                                  keyId, keyOffset, messageLength, CONTAINER_CHUNK_SIZE);
+
+  // Stripe children would otherwise write the header out again when they exit
+  fflush(stdout);
+}
+
+/* Writes the container's index after the encrypted message and its newline: a line with the number of chunks, each
+ * chunk's checksum on a line of its own, and a trailer line of fixed length giving the offset the index starts at. */
+void finishContainer(void) {
+  size_t chunkCount = (outputWritten + CONTAINER_CHUNK_SIZE - 1) / CONTAINER_CHUNK_SIZE;
+
+  fprintf(stdout, "index %zu\n", chunkCount);
+  for (size_t i = 0; i < chunkCount; i++)
+    fprintf(stdout, "%016llx\n", chunkChecksums[i]);
+  fprintf(stdout, "end %020zu\n", containerHeaderLength + outputWritten + 1);
+
+  free(chunkChecksums);
+}
@@ -1,127 +1,492 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define DEFAULT_WORKER_COUNT 5
+#define DEFAULT_MEMORY_BUDGET_MB 256
+#define ARENA_RETAIN_SIZE (1024 * 1024)
+#define ARENA_GRANULE (64 * 1024)
+#define HUGE_PAGE_GRANULE (2 * 1024 * 1024)
+#define WORKER_START_FAILED 3
+#define WORKER_RESTART_DELAY_S 1
+#define STREAM_MAX_CHUNK_SIZE (256 * 1024)
+#define HEADER_MAX_LENGTH 128
+
+/* A worker handles one connection at a time, so a client that stops sending for CONNECTION_TIMEOUT_S (during the
+ * handshake, in the middle of a request or between requests) has its connection closed to free the worker. */
+#define CONNECTION_TIMEOUT_S 10
+
+/* Clients on the same host can also connect through a Unix socket named after the port, and hand over a ring of
+ * shared memory to be encrypted in place instead of streaming the message and key through the socket. */
+#define LOCAL_SOCKET_FORMAT "/tmp/otp_enc_d.%d.sock"
+#define RING_HEADER_SIZE 4096
+#define RING_MAX_SLOTS 64
+#define RING_DESCRIPTOR_COUNT 3
+
+/* Request latencies are counted in buckets whose upper bounds double from LATENCY_BUCKET_BASE_US, and the metrics are
+ * served in Prometheus' text format with names starting with METRIC_PREFIX. */
+#define LATENCY_BUCKET_COUNT 16
+#define LATENCY_BUCKET_BASE_US 16
+#define METRIC_PREFIX "otp_enc_d_"
+#define ADMIN_REQUEST_MAX_LENGTH 4096
+
+/* Generate requests carry only the message, and the daemon draws the pad from the kernel's CSPRNG a batch of random
+ * bytes at a time while it encrypts. The pad is either sent back with the ciphertext or kept in the pad store (-k),
+ * under a name the client chooses. */
+#define RANDOM_BATCH_SIZE 16384
+#define PAD_NAME_MAX_LENGTH 32
+
+/* A daemon started with -t takes over the listening sockets of the daemon already running on its port, which passes
+ * them over a Unix socket named after the port that only the same user can use. Once the new daemon's workers are
+ * ready, the old daemon stops accepting, lets its workers finish the connections they have (for up to
+ * DRAIN_TIMEOUT_S), and exits, so no connection is ever refused. If the new workers aren't ready within
+ * WARMUP_TIMEOUT_MS, the new daemon gives up and the old one carries on. */
+#define HANDOFF_SOCKET_FORMAT "/tmp/otp_enc_d.%d.handoff"
+#define HANDOFF_DESCRIPTOR_COUNT 3
+#define HANDOFF_ATTEMPTS 10
+#define HANDOFF_TIMEOUT_S 30
+#define WARMUP_TIMEOUT_MS 5000
+#define DRAIN_TIMEOUT_S 60
+
+/* Requests are sorted into lanes by their size. Every chunk of work takes a CPU slot from the scheduler, and the
+ * lanes share the slots in proportion to their weights, so a small request only ever waits for the chunk that's
+ * already running rather than for a whole bulk request. */
+#define LANE_SMALL 0
+#define LANE_BULK 1
+#define LANE_COUNT 2
+#define DEFAULT_SMALL_LIMIT 65536
+#define DEFAULT_RESERVED_WORKERS 1
+#define SCHEDULE_CHUNK_SIZE 65536
+#define LANE_STRIDE 65536
+
+const char* laneNames[LANE_COUNT] = {"small", "bulk"};
+const unsigned long laneWeights[LANE_COUNT] = {4, 1};
+
+/* Scheduling state for a single lane. waiting is the number of chunks queued for a CPU slot and active is the number
+ * of requests in the lane being handled. idle is the number of connections held open waiting for their next request
+ * since finishing one in the lane. pass is how much service the lane has had, scaled by its weight. latencyBuckets
+ * counts the lane's finished requests by latency the same way each worker's stats do. */
+struct laneState {
+  unsigned long waiting;
+  unsigned long running;
+  unsigned long active;
+  unsigned long idle;
+  unsigned long pass;
+  unsigned long requests;
+  unsigned long completed;
+  unsigned long rejected;
+  unsigned long long latencyTotal;
+  unsigned long long latencyMax;
+  unsigned long latencyBuckets[LATENCY_BUCKET_COUNT + 1];
+};
+
+/* Stats for a single worker, written only by that worker (and by the parent when it replaces the worker), so they're
+ * updated without locks and read with atomic loads. Each worker's stats start on their own cache line so workers
+ * never slow each other down by writing to the same line. The counters belong to the worker's slot rather than its
+ * process, so they keep counting up across replacement workers. */
+struct workerStats {
+  pid_t pid;
+  unsigned long requests;
+  unsigned long rejected;
+  unsigned long completed;
+  unsigned long errors;
+  unsigned long long bytes;
+  unsigned long long latencyTotal;
+  unsigned long latencyBuckets[LATENCY_BUCKET_COUNT + 1];
+  size_t resident;
+  size_t peak;
+  int lane;
+  int idleLane;
+  int holdingSlot;
+} __attribute__((aligned(64)));
+
+/* State shared between the parent and every worker through an anonymous shared mapping. memoryReserved is the total
+ * of every worker's arena capacity and is only ever changed atomically, so admission needs no lock. The lanes and
+ * free CPU slots are protected by schedulerLock, and workers waiting for a slot sleep on schedulerSequence.
+ * workersReady counts the workers whose arenas are ready, which a daemon taking over with -t waits on. */
+struct poolState {
+  size_t memoryBudget;
+  size_t memoryReserved;
+  int hugePages;
+  int workerCount;
+  unsigned long smallLimit;
+  int reservedWorkers;
+  int schedulerLock;
+  int schedulerSequence;
+  int slotsFree;
+  int workersReady;
+  struct laneState lanes[LANE_COUNT];
+  struct workerStats workers[];
+};
+
+/* The start of a shared memory ring. The client fills slots in order, each with a chunk of message followed by the
+ * same length of key, and counts them in produced. The daemon encrypts each slot's message in place and counts them in
+ * consumed. Both only ever grow, so slot n is at index n modulo the number of slots. */
+struct ringHeader {
+  unsigned long produced;
+  unsigned long consumed;
+};
+
+/* A worker's buffer for requests. It's mapped once when the worker starts and reused for every request it handles,
+ * only growing (within the pool's memory budget) for requests that don't fit. lastLane is the lane of the last request
+ * the worker admitted. */
+struct arena {
+  char* base;
+  size_t capacity;
+  size_t used;
+  int lastLane;
+  struct poolState* pool;
+  struct workerStats* stats;
+};
 
 void encrypt(char[], unsigned long, const char[]);
 void error(const char*);
-void receiveStringFromSocket(const int*, char[], char[], const int*, const char[]);
-void sendStringToSocket(const int*, const char[]);
+void setFlag(int);
+int listenLocally(const char[]);
+int listenForAdmin(const char[]);
+int listenForHandoff(const char[]);
+int receiveHandoff(const char[], int[]);
+int handOver(const int[]);
+int keepInheritedAdmin(int, const char[]);
+int waitForWarmWorkers(struct poolState*);
+int isDraining(void);
+int waitForNextRequest(const int*, struct arena*);
+pid_t spawnWorker(int, int, struct poolState*, int);
+pid_t spawnAdmin(int, struct poolState*);
+void runAdmin(int, struct poolState*);
+void runWorker(int, int, struct poolState*, int);
+int acceptConnection(int, int);
+void handleConnection(const int*, struct arena*);
+void handleStreamRequests(const int*, struct arena*);
+void handleRingRequest(const int*, struct arena*, const char[]);
+void handleStatsRequest(const int*, struct arena*);
+int handleGenerateRequest(const int*, struct arena*, const char[]);
+int generateAndEncrypt(char[], unsigned long, char[]);
+int isValidPadName(const char[]);
+int writeToPadStore(int, const char[], size_t);
+int receiveDescriptors(const int*, int[], int);
+int waitForRing(const int*, int);
+int reserveArena(struct arena*, size_t);
+void trimArena(struct arena*);
+char* mapArenaRegion(size_t, int);
+size_t arenaGranule(const struct poolState*);
+long receiveIntoArena(const int*, struct arena*, const char[]);
+int receiveHeaderLine(const int*, char[], size_t);
+int receiveExactly(const int*, char[], size_t);
+void rejectRequest(const int*, const char[]);
+int classifyRequest(const struct poolState*, unsigned long);
+int admitRequest(struct arena*, int, int);
+void finishRequest(struct arena*, const struct timespec*, unsigned long long);
+void recordError(struct arena*);
+void acquireSlot(struct arena*);
+void releaseSlot(struct arena*);
+void lockScheduler(struct poolState*);
+void unlockScheduler(struct poolState*);
+void printPoolStats(const struct poolState*);
+char* formatMetrics(const struct poolState*, size_t*);
+void appendMetric(char**, size_t*, size_t*, const char*, ...);
+int sendBytesToSocket(const int*, const char[], size_t);
+int sendStringToSocket(const int*, const char[]);
+
+volatile sig_atomic_t statsRequested = 0;
+volatile sig_atomic_t terminateRequested = 0;
+volatile sig_atomic_t handoffRequested = 0;
+volatile sig_atomic_t drainRequested = 0;
+const char* padStoreDirectory = NULL;
+int handoffSocketFD = -1;
+sigset_t drainWaitMask;
 
 int main(int argc, char* argv[]) {
-	int listenSocketFD, establishedConnectionFD, portNumber;
-	socklen_t sizeOfClientInfo;
-  struct sockaddr_in serverAddress, clientAddress;
-  int bufferSize = 150000, messageFragmentSize = 10;
-	char buffer[bufferSize], messageFragment[messageFragmentSize];
-  unsigned long encryptedMessageLength = 0;
-	char* keyRead = NULL;
-  char connectionValidator[] = ">>";
-  char endOfMessage[] = "||";
-  char invalidError[] = "Received an incoming connection from an unknown source.";
+  int listenSocketFD = -1, localSocketFD = -1, adminSocketFD = -1, handoffConnectionFD = -1, portNumber, option;
+  int takeover = 0, handedOff = 0, reservedGiven = 0;
+  int workerCount = DEFAULT_WORKER_COUNT, hugePages = 0, reservedWorkers = DEFAULT_RESERVED_WORKERS;
+  long memoryBudgetMB = DEFAULT_MEMORY_BUDGET_MB, smallLimit = DEFAULT_SMALL_LIMIT;
+  size_t granule = 0, retainSize = 0;
+  struct sockaddr_in serverAddress;
+  struct poolState* pool = NULL;
+  char localSocketPath[sizeof(((struct sockaddr_un*) NULL)->sun_path)];
+  char handoffSocketPath[sizeof(((struct sockaddr_un*) NULL)->sun_path)];
+  int listeningSockets[HANDOFF_DESCRIPTOR_COUNT];
+  struct sigaction flagAction;
+  char* admin = NULL;
   int exitMethod = -5;
-  pid_t spawnPid = -5;
+  pid_t finishedPid = -5, adminPid = -5;
 
   // Check usage & args
-	if (argc < 2) {
-	  fprintf(stderr, "Correct command format: %s PORT\n", argv[0]);
-	  exit(1);
-	}
-
-	// Set up the address struct for this process (the server)
-	memset((char *) &serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
-	portNumber = atoi(argv[1]); // Get the port number, convert to an integer from a string
-	serverAddress.sin_family = AF_INET; // Create a network-capable socket
-	serverAddress.sin_port = htons(portNumber); // Store the port number
-	serverAddress.sin_addr.s_addr = INADDR_ANY; // Any address is allowed for connection to this process
-
-	// Set up the socket
-	listenSocketFD = socket(AF_INET, SOCK_STREAM, 0);
-	if (listenSocketFD < 0)
-	  error("An error occurred opening a socket");
-
-	// Enable the socket to begin listening
-	if (bind(listenSocketFD, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) < 0)
-		error("An error occurred binding to a socket");
-
-  // Flip the socket on - it can now receive up to 5 connections
-	listen(listenSocketFD, 5);
-
-	// Create an infinite loop so we can act like a daemon
-	while (1) {
-    // Get the size of the address for the client that will connect
-    sizeOfClientInfo = sizeof(clientAddress);
-    // Accept a connection, blocking if one is not available until one connects
-    establishedConnectionFD = accept(listenSocketFD, (struct sockaddr*) &clientAddress, &sizeOfClientInfo);
-
-    // Fork a new process for the accepted connection if we didn't detect an error
-    spawnPid = fork();
-    switch (spawnPid) {
-      case -1:
-        error("An error occurred creating a process to handle a new connection");
-      case 0:
-        if (establishedConnectionFD < 0)
-          error("An error occurred accepting a connection");
-
-        // Clear the buffer to receive a message from the client
-        memset(buffer, '\0', bufferSize);
-
-        // Read the client's handshake message from the socket
-        receiveStringFromSocket(&establishedConnectionFD, buffer, messageFragment, &messageFragmentSize, endOfMessage);
-
-        if (strcmp(buffer, connectionValidator) != 0) {
-          // Send back an error message if the wrong program is trying to connect to our daemon
-          sendStringToSocket(&establishedConnectionFD, invalidError);
-          sendStringToSocket(&establishedConnectionFD, endOfMessage);
-        } else {
-          // Send back the connection validator and end of message string if the connection came from otp_enc
-          sendStringToSocket(&establishedConnectionFD, ">>||");
-        }
+  while ((option = getopt(argc, argv, "w:m:Hs:r:a:k:t")) != -1) {
+    switch (option) {
+      case 'w':
+        workerCount = atoi(optarg);
+        break;
+      case 'm':
+        memoryBudgetMB = atol(optarg);
+        break;
+      case 'H':
+        hugePages = 1;
+        break;
+      case 's':
+        smallLimit = atol(optarg);
+        break;
+      case 'r':
+        reservedWorkers = atoi(optarg);
+        reservedGiven = 1;
+        break;
+      case 'a':
+        admin = optarg;
+        break;
+      case 'k':
+        padStoreDirectory = optarg;
+        break;
+      case 't':
+        takeover = 1;
+        break;
+      default:
+        workerCount = -1;
+    }
+  }
+  if (optind >= argc || workerCount < 1 || memoryBudgetMB < 1 || smallLimit < 0 || reservedWorkers < 0 ||
+      (reservedGiven && smallLimit > 0 && reservedWorkers >= workerCount)) {
+    fprintf(stderr, "Correct command format: %s [-w WORKERS] [-m BUDGET_MB] [-H] [-s SMALL_LIMIT] "
+                    "[-r RESERVED_WORKERS] [-a ADMIN_PORT|ADMIN_PATH] [-k PAD_STORE] [-t] PORT\n", argv[0]);
+    exit(1);
+  }
 
-        // Prepare the buffer and receive the full message and key from the client
-        memset(buffer, '\0', sizeof(buffer));
-        receiveStringFromSocket(&establishedConnectionFD, buffer, messageFragment, &messageFragmentSize, endOfMessage);
-
-        /* Our key in the buffer begins after the newline character at the end of the plaintext message,
-         * so we set keyRead to the index in the buffer directly after the new line, then exit our loop. */
-        for (size_t i = 0; i < strlen(buffer); i++) {
-          if (buffer[i] == '\n') {
-            keyRead = buffer + i + 1;
-            break;
-          }
-        }
-        /* Once we've found the location of the key, we know that the length of the message is the length of the full
-         * buffer minus the length of the key and the newline character. */
-        encryptedMessageLength = strlen(buffer) - strlen(keyRead) - 1;
-
-        /* Verify that the length of the key (minus the newline character) was long enough for us to encrypt the
-         * plaintext message. Otherwise, print an error. */
-        if ((strlen(keyRead) - 1) >= encryptedMessageLength) {
-          encrypt(buffer, encryptedMessageLength, keyRead);
-          sendStringToSocket(&establishedConnectionFD, buffer);
-          sendStringToSocket(&establishedConnectionFD, endOfMessage);
-        } else {
-          fprintf(stderr, "The provided key must have at least %lu characters to encrypt the provided message.\n", encryptedMessageLength);
-        }
+  // Without -r, at least one worker is always left free for bulk requests
+  if (!reservedGiven && reservedWorkers >= workerCount)
+    reservedWorkers = workerCount - 1;
 
-        // Close the existing socket which is connected to the client
-        close(establishedConnectionFD);
+  // Every worker's arena starts out at the retained size, rounded up to whole huge pages with -H
+  granule = hugePages ? HUGE_PAGE_GRANULE : ARENA_GRANULE;
+  retainSize = (ARENA_RETAIN_SIZE + granule - 1) / granule * granule;
+  if ((size_t) memoryBudgetMB * 1024 * 1024 < workerCount * retainSize) {
+    fprintf(stderr, "A memory budget of %ld MB is too small for %d workers, which need %zu MB to start.\n",
+            memoryBudgetMB, workerCount, (workerCount * retainSize + 1024 * 1024 - 1) / (1024 * 1024));
+    exit(1);
+  }
 
-      default:
-        // Try to reap any zombie child processes
-        spawnPid = waitpid(-1, &exitMethod, WNOHANG);
-        // Close the existing socket which is connected to the client
-        close(establishedConnectionFD);
+  portNumber = atoi(argv[optind]); // Get the port number, convert to an integer from a string
+  snprintf(localSocketPath, sizeof(localSocketPath), LOCAL_SOCKET_FORMAT, portNumber);
+  snprintf(handoffSocketPath, sizeof(handoffSocketPath), HANDOFF_SOCKET_FORMAT, portNumber);
+
+  if (takeover) {
+    // Share the running daemon's listening sockets instead of binding new ones, so its backlog carries straight over
+    handoffConnectionFD = receiveHandoff(handoffSocketPath, listeningSockets);
+    if (handoffConnectionFD < 0) {
+      fprintf(stderr, "There is no daemon running on port %d to take over from.\n", portNumber);
+      exit(1);
+    }
+    listenSocketFD = listeningSockets[0];
+    localSocketFD = listeningSockets[1];
+    adminSocketFD = listeningSockets[2];
+  } else {
+    // Set up the address struct for this process (the server)
+    memset((char *) &serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
+    serverAddress.sin_family = AF_INET; // Create a network-capable socket
+    serverAddress.sin_port = htons(portNumber); // Store the port number
+    serverAddress.sin_addr.s_addr = INADDR_ANY; // Any address is allowed for connection to this process
+
+    // Set up the socket
+    listenSocketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocketFD < 0)
+      error("An error occurred opening a socket");
+
+    // Enable the socket to begin listening
+    if (bind(listenSocketFD, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) < 0)
+      error("An error occurred binding to a socket");
+
+    // Flip the socket on - it can now receive up to 5 connections
+    listen(listenSocketFD, 5);
+
+    // Listen for clients on this host too, carrying on with only the network socket if that isn't possible
+    localSocketFD = listenLocally(localSocketPath);
+  }
+
+  // Workers wait on every listening socket at once, so one that loses the race for a connection mustn't block in accept
+  fcntl(listenSocketFD, F_SETFL, O_NONBLOCK);
+  if (localSocketFD >= 0)
+    fcntl(localSocketFD, F_SETFL, O_NONBLOCK);
+
+  // Create the state shared with the workers, which have to be able to see each other's memory use
+  pool = mmap(NULL, sizeof(struct poolState) + workerCount * sizeof(struct workerStats), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (pool == MAP_FAILED)
+    error("An error occurred creating the worker pool");
+  pool->memoryBudget = (size_t) memoryBudgetMB * 1024 * 1024;
+  pool->memoryReserved = 0;
+  pool->hugePages = hugePages;
+  pool->workerCount = workerCount;
+  /* A small limit of 0 turns the lanes off, putting every request in the bulk lane with no workers held back for
+   * small requests. There's one CPU slot per processor, so there's always a slot free for a small request's next
+   * chunk within one chunk's time. */
+  pool->smallLimit = smallLimit;
+  pool->reservedWorkers = smallLimit > 0 ? reservedWorkers : 0;
+  pool->slotsFree = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+  /* SIGUSR1 prints the pool's stats, SIGTERM shuts the workers down with the parent, SIGIO means a new daemon
+   * wants to take over and SIGALRM means a drain has gone on too long. None of the handlers restart waitpid, so the
+   * loop below gets a chance to act on the flags. Workers handle a closed client connection through the error from
+   * send rather than being killed by SIGPIPE. */
+  memset(&flagAction, '\0', sizeof(flagAction));
+  flagAction.sa_handler = setFlag;
+  sigaction(SIGUSR1, &flagAction, NULL);
+  sigaction(SIGTERM, &flagAction, NULL);
+  sigaction(SIGINT, &flagAction, NULL);
+  sigaction(SIGIO, &flagAction, NULL);
+  sigaction(SIGALRM, &flagAction, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Start every worker, each of which accepts connections on the listening socket by itself
+  for (int i = 0; i < workerCount; i++)
+    pool->workers[i].pid = spawnWorker(listenSocketFD, localSocketFD, pool, i);
+
+  /* Only take over once every worker has its arena mapped and ready. Otherwise leave everything to the old daemon,
+   * which goes on serving once the handoff connection closes without the go-ahead. */
+  if (takeover && waitForWarmWorkers(pool) < 0) {
+    fprintf(stderr, "The workers weren't ready in time, so the daemon already on port %d was left running.\n",
+            portNumber);
+    close(handoffConnectionFD);
+    for (int i = 0; i < workerCount; i++)
+      kill(pool->workers[i].pid, SIGTERM);
+    while (wait(NULL) > 0 || errno == EINTR);
+    exit(1);
+  }
+
+  // Serve the metrics from a process of their own, if asked to, so scraping them never holds up a request
+  if (adminSocketFD >= 0)
+    adminSocketFD = keepInheritedAdmin(adminSocketFD, admin);
+  if (admin != NULL) {
+    if (adminSocketFD < 0)
+      adminSocketFD = listenForAdmin(admin);
+    adminPid = spawnAdmin(adminSocketFD, pool);
+  }
+
+  // Tell the old daemon to stop accepting, now that this one is serving everything it did
+  if (takeover) {
+    send(handoffConnectionFD, "R", 1, 0);
+    close(handoffConnectionFD);
+  }
+
+  // Wait for the next daemon that wants to take over, which replaces the old daemon's socket if there was one
+  handoffSocketFD = listenForHandoff(handoffSocketPath);
+
+  // Replace any worker that exits, for as long as the daemon is running and hasn't been taken over
+  while (!terminateRequested && !handedOff) {
+    finishedPid = waitpid(-1, &exitMethod, 0);
+
+    if (finishedPid < 0) {
+      if (errno != EINTR)
+        error("An error occurred waiting for a worker");
+      if (statsRequested) {
+        printPoolStats(pool);
+        statsRequested = 0;
+      }
+      if (handoffRequested) {
+        handoffRequested = 0;
+        listeningSockets[0] = listenSocketFD;
+        listeningSockets[1] = localSocketFD;
+        listeningSockets[2] = adminSocketFD;
+        handedOff = handOver(listeningSockets) == 0;
+      }
+      continue;
     }
 
+    if (finishedPid == adminPid) {
+      adminPid = spawnAdmin(adminSocketFD, pool);
+      continue;
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+      if (pool->workers[i].pid == finishedPid) {
+        // Return whatever the worker had reserved to the budget before starting its replacement
+        __atomic_fetch_sub(&pool->memoryReserved, pool->workers[i].resident, __ATOMIC_SEQ_CST);
+        pool->workers[i].resident = 0;
+
+        // Return any CPU slot and place in a lane the worker had, too
+        lockScheduler(pool);
+        if (pool->workers[i].holdingSlot) {
+          pool->slotsFree++;
+          pool->lanes[pool->workers[i].lane].running--;
+        }
+        if (pool->workers[i].lane >= 0)
+          pool->lanes[pool->workers[i].lane].active--;
+        if (pool->workers[i].idleLane >= 0)
+          pool->lanes[pool->workers[i].idleLane].idle--;
+        pool->schedulerSequence++;
+        unlockScheduler(pool);
+        syscall(SYS_futex, &pool->schedulerSequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+        /* A worker that couldn't start (because other workers' large requests have the budget right now) is only
+         * replaced after a pause, so the parent doesn't fork one failing worker after another. */
+        if (WIFEXITED(exitMethod) && WEXITSTATUS(exitMethod) == WORKER_START_FAILED)
+          sleep(WORKER_RESTART_DELAY_S);
+        pool->workers[i].pid = spawnWorker(listenSocketFD, localSocketFD, pool, i);
+        break;
+      }
+    }
+  }
 
-	}
-  // Close the listening socket
+  if (handedOff) {
+    /* The new daemon is accepting connections now, so stop serving metrics and let each worker finish the connection
+     * it has before it exits. Being told to stop while draining, or still draining after DRAIN_TIMEOUT_S, stops the
+     * workers straight away. */
+    if (adminPid > 0)
+      kill(adminPid, SIGTERM);
+    for (int i = 0; i < workerCount; i++)
+      kill(pool->workers[i].pid, SIGUSR2);
+    alarm(DRAIN_TIMEOUT_S);
+    while (wait(NULL) > 0 || errno == EINTR) {
+      for (int i = 0; terminateRequested && i < workerCount; i++)
+        kill(pool->workers[i].pid, SIGTERM);
+    }
+  } else {
+    // Stop the workers, and the metrics process if there is one
+    for (int i = 0; i < workerCount; i++)
+      kill(pool->workers[i].pid, SIGTERM);
+    if (adminPid > 0)
+      kill(adminPid, SIGTERM);
+    while (wait(NULL) > 0);
+  }
+
+  // Close the listening sockets, leaving their paths in place if they now belong to the daemon that took over
   close(listenSocketFD);
+  if (localSocketFD >= 0) {
+    close(localSocketFD);
+    if (!handedOff)
+      unlink(localSocketPath);
+  }
+  if (adminSocketFD >= 0) {
+    close(adminSocketFD);
+    if (strchr(admin, '/') != NULL && !handedOff)
+      unlink(admin);
+  }
+  if (handoffSocketFD >= 0) {
+    close(handoffSocketFD);
+    if (!handedOff)
+      unlink(handoffSocketPath);
+  }
   return(0);
 }
 
@@ -161,55 +526,1489 @@ void error(const char* msg) {
   exit(1);
 }
 
-/* Takes a socket, a message buffer, a smaller array to hold characters as they're read, the size of the array, and a
- * small string used by client and server to indicate the end of a message. The function loops through until the
- * substring is found, as seen in the Network Clients video for block 4, repeatedly adding the message fragment
- * to the end of the message. The substring that marks the end of the message is then replaced with a null terminator. */
-void receiveStringFromSocket(const int* establishedConnectionFD, char message[], char messageFragment[], const int* messageFragmentSize, const char endOfMessage[]) {
-  int charsRead = -5;
-  long terminalLocation = -5;
+// Signal handler that records which signal arrived so the parent's loop can handle it outside of the handler
+void setFlag(int signalNumber) {
+  if (signalNumber == SIGUSR1)
+    statsRequested = 1;
+  else if (signalNumber == SIGIO)
+    handoffRequested = 1;
+  else if (signalNumber == SIGUSR2)
+    drainRequested = 1;
+  else
+    terminateRequested = 1;
+}
+
+/* Takes a path, then listens on a Unix socket at that path, replacing whatever a daemon that didn't shut down cleanly
+ * left there. Returns the listening socket, or -1 (after saying why) if there won't be one. */
+int listenLocally(const char path[]) {
+  int localSocketFD = -5;
+  struct sockaddr_un localAddress;
+
+  memset((char*) &localAddress, '\0', sizeof(localAddress));
+  localAddress.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(localAddress.sun_path)) {
+    fprintf(stderr, "The local socket path %s is too long.\n", path);
+    return(-1);
+  }
+  strcpy(localAddress.sun_path, path);
+
+  localSocketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (localSocketFD < 0) {
+    perror("An error occurred opening a local socket");
+    return(-1);
+  }
+
+  unlink(path);
+  if (bind(localSocketFD, (struct sockaddr*) &localAddress, sizeof(localAddress)) < 0) {
+    perror("An error occurred binding to a local socket");
+    close(localSocketFD);
+    return(-1);
+  }
+  listen(localSocketFD, 5);
+
+  return(localSocketFD);
+}
+
+/* Takes the -a argument, which is either a port number or (if it has a slash) the path of a Unix socket, then listens
+ * for metrics scrapes there. Admin ports only accept connections from this host. Returns the listening socket. */
+int listenForAdmin(const char admin[]) {
+  int adminSocketFD = -5, reuse = 1;
+  struct sockaddr_in adminAddress;
+
+  if (strchr(admin, '/') != NULL) {
+    adminSocketFD = listenLocally(admin);
+    if (adminSocketFD < 0)
+      exit(1);
+    return(adminSocketFD);
+  }
+
+  memset((char*) &adminAddress, '\0', sizeof(adminAddress));
+  adminAddress.sin_family = AF_INET;
+  adminAddress.sin_port = htons(atoi(admin));
+  adminAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  adminSocketFD = socket(AF_INET, SOCK_STREAM, 0);
+  if (adminSocketFD < 0)
+    error("An error occurred opening the admin socket");
+  setsockopt(adminSocketFD, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(adminSocketFD, (struct sockaddr*) &adminAddress, sizeof(adminAddress)) < 0)
+    error("An error occurred binding to the admin socket");
+  listen(adminSocketFD, 5);
+
+  return(adminSocketFD);
+}
+
+/* Takes the path of the handoff socket, then listens there for a new daemon that wants to take over. The kernel sends
+ * the parent SIGIO when one connects, which interrupts its waitpid. Returns the listening socket, or -1 if there
+ * won't be one, in which case this daemon can't be taken over. */
+int listenForHandoff(const char path[]) {
+  int listeningFD = listenLocally(path);
+
+  if (listeningFD < 0)
+    return(-1);
+  chmod(path, 0600);
+  fcntl(listeningFD, F_SETOWN, getpid());
+  fcntl(listeningFD, F_SETFL, O_NONBLOCK | O_ASYNC);
+
+  return(listeningFD);
+}
+
+/* Takes the path of the running daemon's handoff socket and an array for its network, local and admin listening
+ * sockets, then connects and receives them, with -1 for any it doesn't have. The running daemon only notices the
+ * connection when its SIGIO arrives, so if nothing comes back for a second the connection is made again in case the
+ * signal was missed. Returns the connection to send the running daemon the go-ahead on, or -1 if there's no daemon
+ * to take over from. */
+int receiveHandoff(const char path[], int descriptors[]) {
+  char present[HANDOFF_DESCRIPTOR_COUNT];
+  char control[CMSG_SPACE(HANDOFF_DESCRIPTOR_COUNT * sizeof(int))];
+  struct iovec presentVector = {present, sizeof(present)};
+  struct msghdr message;
+  struct cmsghdr* controlMessage = NULL;
+  struct sockaddr_un handoffAddress;
+  struct timeval timeout = {1, 0};
+  int handoffFD = -1, received = 0;
+
+  memset((char*) &handoffAddress, '\0', sizeof(handoffAddress));
+  handoffAddress.sun_family = AF_UNIX;
+  strncpy(handoffAddress.sun_path, path, sizeof(handoffAddress.sun_path) - 1);
+
+  for (int attempt = 0; attempt < HANDOFF_ATTEMPTS && !received; attempt++) {
+    handoffFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (handoffFD < 0 || connect(handoffFD, (struct sockaddr*) &handoffAddress, sizeof(handoffAddress)) < 0) {
+      close(handoffFD);
+      return(-1);
+    }
+    setsockopt(handoffFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    memset(&message, '\0', sizeof(message));
+    memset(control, '\0', sizeof(control));
+    message.msg_iov = &presentVector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(handoffFD, &message, MSG_WAITALL) == sizeof(present))
+      received = 1;
+    else
+      close(handoffFD);
+  }
+  if (!received)
+    return(-1);
+
+  // Each socket the running daemon has is marked in present, and they arrive in the same order
+  controlMessage = CMSG_FIRSTHDR(&message);
+  if (controlMessage == NULL || controlMessage->cmsg_level != SOL_SOCKET || controlMessage->cmsg_type != SCM_RIGHTS) {
+    close(handoffFD);
+    return(-1);
+  }
+  for (int i = 0, passed = 0; i < HANDOFF_DESCRIPTOR_COUNT; i++)
+    descriptors[i] = present[i] == '1' ? ((int*) CMSG_DATA(controlMessage))[passed++] : -1;
+  if (descriptors[0] < 0) {
+    close(handoffFD);
+    return(-1);
+  }
+
+  return(handoffFD);
+}
+
+/* Takes the daemon's network, local and admin listening sockets (-1 for any it doesn't have), then accepts each new
+ * daemon waiting on the handoff socket and passes them over, until one says its workers are ready. Only a process
+ * running as the same user as this one is given them. From then on both daemons accept connections from the same
+ * sockets, until this one stops. Returns 0 once the sockets have been taken over, or -1 if nobody took them. */
+int handOver(const int descriptors[]) {
+  int connectionFD = -5, passedCount = 0, passed[HANDOFF_DESCRIPTOR_COUNT];
+  char present[HANDOFF_DESCRIPTOR_COUNT], ready = '\0';
+  char control[CMSG_SPACE(HANDOFF_DESCRIPTOR_COUNT * sizeof(int))];
+  struct iovec presentVector = {present, sizeof(present)};
+  struct msghdr message;
+  struct cmsghdr* controlMessage = NULL;
+  struct timeval timeout = {HANDOFF_TIMEOUT_S, 0};
+  struct ucred peer;
+  socklen_t peerLength = sizeof(peer);
+  ssize_t charsRead = -5;
+
+  for (int i = 0; i < HANDOFF_DESCRIPTOR_COUNT; i++) {
+    present[i] = descriptors[i] >= 0 ? '1' : '0';
+    if (descriptors[i] >= 0)
+      passed[passedCount++] = descriptors[i];
+  }
+
+  memset(&message, '\0', sizeof(message));
+  memset(control, '\0', sizeof(control));
+  message.msg_iov = &presentVector;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = CMSG_SPACE(passedCount * sizeof(int));
+  controlMessage = CMSG_FIRSTHDR(&message);
+  controlMessage->cmsg_level = SOL_SOCKET;
+  controlMessage->cmsg_type = SCM_RIGHTS;
+  controlMessage->cmsg_len = CMSG_LEN(passedCount * sizeof(int));
+  memcpy(CMSG_DATA(controlMessage), passed, passedCount * sizeof(int));
+
+  while (handoffSocketFD >= 0 && (connectionFD = accept(handoffSocketFD, NULL, NULL)) >= 0) {
+    peerLength = sizeof(peer);
+    if (getsockopt(connectionFD, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) < 0 || peer.uid != geteuid()) {
+      close(connectionFD);
+      continue;
+    }
+
+    // Wait for the new daemon to warm its workers up, however long that takes, unless this daemon is told to stop
+    fcntl(connectionFD, F_SETFL, 0);
+    setsockopt(connectionFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (sendmsg(connectionFD, &message, 0) == sizeof(present)) {
+      while ((charsRead = recv(connectionFD, &ready, 1, 0)) < 0 && errno == EINTR && !terminateRequested);
+      if (charsRead == 1 && ready == 'R') {
+        close(connectionFD);
+        return(0);
+      }
+    }
+    close(connectionFD);
+  }
+
+  return(-1);
+}
+
+/* Takes an admin listening socket taken over from the old daemon and this daemon's -a argument (NULL without one),
+ * then keeps the socket only if it's listening where -a says. Otherwise it's closed, and its path removed if it has
+ * one, since the old daemon leaves that to whoever takes over. Returns the socket if it was kept, or -1 if not. */
+int keepInheritedAdmin(int adminSocketFD, const char admin[]) {
+  struct sockaddr_storage address;
+  struct sockaddr_un* localAddress = (struct sockaddr_un*) &address;
+  struct sockaddr_in* networkAddress = (struct sockaddr_in*) &address;
+  socklen_t addressLength = sizeof(address);
+  int matches = 0;
+
+  memset(&address, '\0', sizeof(address));
+  if (getsockname(adminSocketFD, (struct sockaddr*) &address, &addressLength) == 0 && admin != NULL) {
+    if (address.ss_family == AF_UNIX)
+      matches = strchr(admin, '/') != NULL && strcmp(localAddress->sun_path, admin) == 0;
+    else if (address.ss_family == AF_INET)
+      matches = strchr(admin, '/') == NULL && ntohs(networkAddress->sin_port) == atoi(admin);
+  }
+  if (matches)
+    return(adminSocketFD);
+
+  close(adminSocketFD);
+  if (address.ss_family == AF_UNIX && localAddress->sun_path[0] != '\0')
+    unlink(localAddress->sun_path);
+  return(-1);
+}
+
+/* Takes the shared pool state, then waits until every worker has its arena ready, giving up after WARMUP_TIMEOUT_MS
+ * or if the daemon is told to stop. Returns 0 once every worker is ready, or -1 if they weren't. */
+int waitForWarmWorkers(struct poolState* pool) {
+  struct timespec now, deadline, pause = {0, 100 * 1000000};
+  int ready = 0;
 
-  while (strstr(message, endOfMessage) == NULL) {
-    memset(messageFragment, '\0', *messageFragmentSize);
-    charsRead = recv(*establishedConnectionFD, messageFragment, *messageFragmentSize - 1, 0);
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += WARMUP_TIMEOUT_MS / 1000;
+  deadline.tv_nsec += (WARMUP_TIMEOUT_MS % 1000) * 1000000;
 
-    // Exit the loop if we either don't read any more characters when receiving, or we failed to retrieve any characters
-    if (charsRead == 0)
+  while ((ready = __atomic_load_n(&pool->workersReady, __ATOMIC_SEQ_CST)) < pool->workerCount && !terminateRequested) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
       break;
-    if (charsRead == -1)
+    syscall(SYS_futex, &pool->workersReady, FUTEX_WAIT, ready, &pause, NULL, 0);
+  }
+
+  return(ready == pool->workerCount && !terminateRequested ? 0 : -1);
+}
+
+/* Takes the admin listening socket and the shared pool state, then forks the process that serves the metrics, the
+ * same way spawnWorker does for workers. Returns the process ID to the parent. */
+pid_t spawnAdmin(int adminSocketFD, struct poolState* pool) {
+  sigset_t blockedSignals, previousSignals;
+  pid_t spawnPid = -5;
+
+  sigemptyset(&blockedSignals);
+  sigaddset(&blockedSignals, SIGTERM);
+  sigaddset(&blockedSignals, SIGINT);
+  sigaddset(&blockedSignals, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &blockedSignals, &previousSignals);
+
+  spawnPid = fork();
+  switch (spawnPid) {
+    case -1:
+      error("An error occurred creating the admin process");
+    case 0:
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGUSR1, SIG_IGN);
+      if (handoffSocketFD >= 0)
+        close(handoffSocketFD);
+      sigprocmask(SIG_SETMASK, &previousSignals, NULL);
+      runAdmin(adminSocketFD, pool);
+      exit(0);
+    default:
+      sigprocmask(SIG_SETMASK, &previousSignals, NULL);
+      return(spawnPid);
+  }
+}
+
+/* Takes the admin listening socket and the shared pool state, then answers every connection with the current metrics
+ * as an HTTP response, whatever was asked for, so they can be scraped by Prometheus or read with curl. */
+void runAdmin(int adminSocketFD, struct poolState* pool) {
+  int scrapeFD = -5;
+  char request[ADMIN_REQUEST_MAX_LENGTH + 1], responseHeader[256];
+  size_t requestLength = 0, metricsLength = 0;
+  ssize_t charsRead = -5;
+  char* metrics = NULL;
+
+  while (1) {
+    scrapeFD = accept(adminSocketFD, NULL, NULL);
+    if (scrapeFD < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      error("An error occurred accepting an admin connection");
+    }
+
+    // Read the request up to the blank line that ends its headers, though nothing in it changes the response
+    requestLength = 0;
+    request[0] = '\0';
+    while (requestLength < ADMIN_REQUEST_MAX_LENGTH && strstr(request, "\r\n\r\n") == NULL &&
+           strstr(request, "\n\n") == NULL) {
+      charsRead = recv(scrapeFD, request + requestLength, ADMIN_REQUEST_MAX_LENGTH - requestLength, 0);
+      if (charsRead <= 0)
+        break;
+      requestLength += charsRead;
+      request[requestLength] = '\0';
+    }
+
+    metrics = formatMetrics(pool, &metricsLength);
+    snprintf(responseHeader, sizeof(responseHeader), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\nConnection: close\r\n\r\n", metricsLength);
+    sendStringToSocket(&scrapeFD, responseHeader);
+    sendBytesToSocket(&scrapeFD, metrics, metricsLength);
+    free(metrics);
+    close(scrapeFD);
+  }
+}
+
+/* Takes the listening sockets, the shared pool state and the index of a worker's slot in the pool, then forks a
+ * worker process for that slot. The parent's signals are blocked until the worker has restored the default
+ * handlers, so a SIGTERM sent during the fork can't be caught by the parent's handler inside the worker and lost.
+ * SIGUSR2 tells the worker to drain, and stays blocked in the worker except while it's waiting for a connection or
+ * the next request, so a request is never interrupted by it. Returns the worker's process ID to the parent. */
+pid_t spawnWorker(int listenSocketFD, int localSocketFD, struct poolState* pool, int workerIndex) {
+  sigset_t blockedSignals, previousSignals;
+  pid_t spawnPid = -5;
+
+  sigemptyset(&blockedSignals);
+  sigaddset(&blockedSignals, SIGTERM);
+  sigaddset(&blockedSignals, SIGINT);
+  sigaddset(&blockedSignals, SIGUSR1);
+  sigaddset(&blockedSignals, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &blockedSignals, &previousSignals);
+
+  pool->workers[workerIndex].lane = -1;
+  pool->workers[workerIndex].idleLane = -1;
+  pool->workers[workerIndex].holdingSlot = 0;
+
+  spawnPid = fork();
+  switch (spawnPid) {
+    case -1:
+      error("An error occurred creating a worker process");
+    case 0:
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGUSR1, SIG_IGN);
+      signal(SIGUSR2, setFlag);
+      if (handoffSocketFD >= 0)
+        close(handoffSocketFD);
+      drainWaitMask = previousSignals;
+      sigdelset(&drainWaitMask, SIGUSR2);
+      sigaddset(&previousSignals, SIGUSR2);
+      sigprocmask(SIG_SETMASK, &previousSignals, NULL);
+      runWorker(listenSocketFD, localSocketFD, pool, workerIndex);
+      exit(0);
+    default:
+      sigprocmask(SIG_SETMASK, &previousSignals, NULL);
+      return(spawnPid);
+  }
+}
+
+/* Takes the listening sockets, the shared pool state and the worker's slot, then maps and pre-faults the worker's
+ * arena and loops accepting and handling one connection at a time, reusing the arena for each of them, until the
+ * worker is told to drain. */
+void runWorker(int listenSocketFD, int localSocketFD, struct poolState* pool, int workerIndex) {
+  int establishedConnectionFD, noDelay = 1;
+  struct timeval receiveTimeout = {CONNECTION_TIMEOUT_S, 0};
+  struct arena workerArena;
+
+  memset(&workerArena, '\0', sizeof(workerArena));
+  workerArena.pool = pool;
+  workerArena.stats = &pool->workers[workerIndex];
+  workerArena.stats->pid = getpid();
+  workerArena.stats->peak = 0;
+
+  // Touch every page of the arena now so the first requests don't pay for the page faults
+  if (reserveArena(&workerArena, ARENA_RETAIN_SIZE) < 0) {
+    fprintf(stderr, "The memory budget is too small to start a worker.\n");
+    exit(WORKER_START_FAILED);
+  }
+  memset(workerArena.base, '\0', workerArena.capacity);
+
+  // Let a daemon that's taking over know this worker is ready for connections
+  __atomic_add_fetch(&pool->workersReady, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &pool->workersReady, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+  while (!isDraining()) {
+    // Accept a connection on either socket, blocking if one is not available until one connects
+    establishedConnectionFD = acceptConnection(listenSocketFD, localSocketFD);
+    if (establishedConnectionFD < 0)
+      continue;
+
+    /* Send status lines and small responses right away instead of waiting for earlier replies to be acknowledged,
+     * and give up on a client that stops sending, so an idle connection can't keep the worker forever. */
+    setsockopt(establishedConnectionFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    setsockopt(establishedConnectionFD, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+
+    handleConnection(&establishedConnectionFD, &workerArena);
+
+    // Close the existing socket which is connected to the client, then give back memory a large request needed
+    close(establishedConnectionFD);
+    trimArena(&workerArena);
+  }
+}
+
+/* Takes the network and local listening sockets (-1 if there's no local socket), then waits until either has a
+ * connection waiting and accepts it. Every worker waits on the same sockets, so a worker that loses the race for a
+ * connection just goes back to waiting. The wait ends early if the worker is told to drain. Returns the connected
+ * socket, or -1 if there wasn't one after all. */
+int acceptConnection(int listenSocketFD, int localSocketFD) {
+  struct pollfd listeners[2];
+  int establishedConnectionFD = -5;
+
+  listeners[0].fd = listenSocketFD;
+  listeners[1].fd = localSocketFD;
+  listeners[0].events = listeners[1].events = POLLIN;
+
+  if (isDraining())
+    return(-1);
+  if (ppoll(listeners, 2, NULL, &drainWaitMask) < 0) {
+    if (errno != EINTR)
+      error("An error occurred waiting for a connection");
+    return(-1);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (!(listeners[i].revents & POLLIN))
+      continue;
+    establishedConnectionFD = accept(listeners[i].fd, NULL, NULL);
+    if (establishedConnectionFD >= 0) {
+      // Accepted sockets inherit the listening socket's flags, but requests are read with blocking calls
+      fcntl(establishedConnectionFD, F_SETFL, 0);
+      return(establishedConnectionFD);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+      error("An error occurred accepting a connection");
+  }
+
+  return(-1);
+}
+
+/* Takes a connected socket and the worker's arena, then performs the handshake with the client, receives the
+ * message and key into the arena, and sends back the encrypted message. */
+void handleConnection(const int* establishedConnectionFD, struct arena* workerArena) {
+  char connectionValidator[] = ">>";
+  char endOfMessage[] = "||";
+  char invalidError[] = "Received an incoming connection from an unknown source.";
+  char* keyRead = NULL;
+  char requestType = '\0', savedCharacter = '\0';
+  long receivedLength = -5;
+  unsigned long encryptedMessageLength = 0, keyLength = 0, chunkLength = 0;
+  struct timespec startTime;
+
+  // Read the client's handshake message from the socket
+  if (receiveIntoArena(establishedConnectionFD, workerArena, endOfMessage) < 0)
+    return;
+
+  if (strcmp(workerArena->base, connectionValidator) != 0) {
+    // Send back an error message if the wrong program is trying to connect to our daemon
+    recordError(workerArena);
+    sendStringToSocket(establishedConnectionFD, invalidError);
+    sendStringToSocket(establishedConnectionFD, endOfMessage);
+    return;
+  }
+
+  // Send back the connection validator and end of message string if the connection came from otp_enc
+  sendStringToSocket(establishedConnectionFD, ">>||");
+
+  // Requests that start with a header are streamed, anything else is the original message and key format
+  if (recv(*establishedConnectionFD, &requestType, 1, MSG_PEEK) <= 0)
+    return;
+  if (requestType == '#') {
+    handleStreamRequests(establishedConnectionFD, workerArena);
+    return;
+  }
+
+  // Receive the full message and key from the client
+  receivedLength = receiveIntoArena(establishedConnectionFD, workerArena, endOfMessage);
+  if (receivedLength == -2) {
+    fprintf(stderr, "A request was rejected because it would exceed the daemon's memory budget.\n");
+    return;
+  }
+  if (receivedLength < 0)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+  /* Our key in the buffer begins after the newline character at the end of the plaintext message, so we set
+   * keyRead to the index in the buffer directly after the new line. */
+  keyRead = memchr(workerArena->base, '\n', receivedLength);
+  if (keyRead == NULL) {
+    recordError(workerArena);
+    fprintf(stderr, "A request was received without a key.\n");
+    return;
+  }
+  keyRead++;
+  /* Once we've found the location of the key, we know that the length of the message is the length of the full
+   * buffer minus the length of the key and the newline character. */
+  keyLength = receivedLength - (keyRead - workerArena->base);
+  encryptedMessageLength = receivedLength - keyLength - 1;
+
+  /* Verify that the length of the key (minus the newline character) was long enough for us to encrypt the
+   * plaintext message. Otherwise, print an error. */
+  if (keyLength > encryptedMessageLength) {
+    /* The message has already arrived (and there's no way to tell the client to try again), so it's always admitted
+     * and only needs its lane for CPU time. It's encrypted a chunk at a time like a stream request so a large one
+     * can't hold a CPU slot for long. encrypt ends each chunk with a null terminator, so the character it overwrites
+     * is put back afterwards. */
+    admitRequest(workerArena, classifyRequest(workerArena->pool, encryptedMessageLength), 0);
+    for (unsigned long offset = 0; offset < encryptedMessageLength; offset += chunkLength) {
+      chunkLength = encryptedMessageLength - offset < SCHEDULE_CHUNK_SIZE ? encryptedMessageLength - offset : SCHEDULE_CHUNK_SIZE;
+      savedCharacter = workerArena->base[offset + chunkLength];
+      acquireSlot(workerArena);
+      encrypt(workerArena->base + offset, chunkLength, keyRead + offset);
+      releaseSlot(workerArena);
+      workerArena->base[offset + chunkLength] = savedCharacter;
+    }
+    workerArena->base[encryptedMessageLength] = '\0';
+    sendBytesToSocket(establishedConnectionFD, workerArena->base, encryptedMessageLength);
+    sendStringToSocket(establishedConnectionFD, endOfMessage);
+    finishRequest(workerArena, &startTime, encryptedMessageLength);
+  } else {
+    recordError(workerArena);
+    fprintf(stderr, "The provided key must have at least %lu characters to encrypt the provided message.\n", encryptedMessageLength);
+  }
+}
+
+/* Takes a connected socket and the worker's arena, then handles stream requests until the client closes the
+ * connection. Each request starts with a header line of "#S", the message length and the chunk size. The message and
+ * key follow interleaved, a chunk of message and then the same length of key, and each chunk is encrypted and sent
+ * back as soon as it has arrived instead of after the whole message. The client gets a status line before its
+ * encrypted message: "+" if the request was accepted, "~" if the daemon is too busy for it right now and it should
+ * be tried again later, or "-" followed by the reason it wasn't accepted. A worker that's draining always handles
+ * the first request, which the client sent expecting an answer, but turns away any after it as busy so the client
+ * sends them again to the daemon that took over. A connection that sits idle between requests is just closed. */
+void handleStreamRequests(const int* establishedConnectionFD, struct arena* workerArena) {
+  char header[HEADER_MAX_LENGTH];
+  int waitResult = 0;
+  unsigned long messageLength = 0, chunkSize = 0, chunkLength = 0;
+  struct timespec startTime;
+
+  for (int served = 0; served == 0 || (waitResult = waitForNextRequest(establishedConnectionFD, workerArena)) == 0;
+       served++) {
+    if (receiveHeaderLine(establishedConnectionFD, header, sizeof(header)) < 0)
+      return;
+
+    // Clients connected through the local socket can ask for a shared memory ring instead
+    if (strncmp(header, "#R ", 3) == 0) {
+      handleRingRequest(establishedConnectionFD, workerArena, header);
+      return;
+    }
+    if (strcmp(header, "#Q") == 0) {
+      handleStatsRequest(establishedConnectionFD, workerArena);
+      return;
+    }
+    if (strncmp(header, "#G ", 3) == 0) {
+      if (handleGenerateRequest(establishedConnectionFD, workerArena, header) < 0)
+        return;
+      continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    if (sscanf(header, "#S %lu %lu", &messageLength, &chunkSize) != 2 || chunkSize < 1 ||
+        chunkSize > STREAM_MAX_CHUNK_SIZE) {
+      recordError(workerArena);
+      rejectRequest(establishedConnectionFD, "-The request header was not recognized.\n");
+      return;
+    }
+
+    // Only one chunk of message and key is held at a time, however long the message is
+    if (reserveArena(workerArena, 2 * chunkSize + 1) < 0) {
+      rejectRequest(establishedConnectionFD, "-The request would exceed the daemon's memory budget.\n");
+      return;
+    }
+
+    // Keep some workers free for small requests by turning away bulk requests that would need them
+    if (admitRequest(workerArena, classifyRequest(workerArena->pool, messageLength), 1) < 0) {
+      rejectRequest(establishedConnectionFD, "~The daemon is busy with bulk requests.\n");
+      return;
+    }
+    sendStringToSocket(establishedConnectionFD, "+\n");
+
+    for (unsigned long offset = 0; offset < messageLength; offset += chunkLength) {
+      chunkLength = messageLength - offset < chunkSize ? messageLength - offset : chunkSize;
+      if (receiveExactly(establishedConnectionFD, workerArena->base, 2 * chunkLength) < 0) {
+        recordError(workerArena);
+        finishRequest(workerArena, &startTime, offset);
+        return;
+      }
+      acquireSlot(workerArena);
+      encrypt(workerArena->base, chunkLength, workerArena->base + chunkLength);
+      releaseSlot(workerArena);
+      sendBytesToSocket(establishedConnectionFD, workerArena->base, chunkLength);
+    }
+    finishRequest(workerArena, &startTime, messageLength);
+  }
+
+  if (waitResult == -1)
+    rejectRequest(establishedConnectionFD, "~The daemon is restarting.\n");
+}
+
+/* Takes a socket connected through the local socket, the worker's arena and a ring request's header line, which has
+ * the message length, the number of slots in the ring and the size of each slot. Once the request is accepted the
+ * client passes over the ring's memory and two event counters, one it adds to when slots have been filled and one the
+ * daemon adds to when they've been encrypted. Each slot is encrypted in place, so none of the message or key passes
+ * through the socket, or through the arena. The status lines are the same as for stream requests. */
+void handleRingRequest(const int* establishedConnectionFD, struct arena* workerArena, const char header[]) {
+  unsigned long messageLength = 0, slotCount = 0, slotSize = 0, chunkLength = 0, chunk = 0;
+  int ringFDs[RING_DESCRIPTOR_COUNT];
+  int seals = 0;
+  size_t ringSize = 0;
+  char* ring = MAP_FAILED;
+  char* slot = NULL;
+  struct ringHeader* positions = NULL;
+  struct stat ringInfo;
+  struct timespec startTime;
+  unsigned long long finished = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &startTime);
+  if (sscanf(header, "#R %lu %lu %lu", &messageLength, &slotCount, &slotSize) != 3 || slotCount < 1 ||
+      slotCount > RING_MAX_SLOTS || slotSize < 1 || slotSize > STREAM_MAX_CHUNK_SIZE) {
+    recordError(workerArena);
+    rejectRequest(establishedConnectionFD, "-The request header was not recognized.\n");
+    return;
+  }
+
+  if (admitRequest(workerArena, classifyRequest(workerArena->pool, messageLength), 1) < 0) {
+    rejectRequest(establishedConnectionFD, "~The daemon is busy with bulk requests.\n");
+    return;
+  }
+  sendStringToSocket(establishedConnectionFD, "+\n");
+
+  /* Map the ring, making sure it's as large as the header said before touching it. It also has to be sealed against
+   * shrinking, since a client that shrank it afterwards would leave the mapping pointing past the end of the file. */
+  ringSize = RING_HEADER_SIZE + slotCount * 2 * slotSize;
+  if (receiveDescriptors(establishedConnectionFD, ringFDs, RING_DESCRIPTOR_COUNT) < 0) {
+    recordError(workerArena);
+    finishRequest(workerArena, &startTime, 0);
+    return;
+  }
+  seals = fcntl(ringFDs[0], F_GET_SEALS);
+  if (seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(ringFDs[0], &ringInfo) == 0 && (size_t) ringInfo.st_size >= ringSize)
+    ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, ringFDs[0], 0);
+
+  if (ring != MAP_FAILED) {
+    positions = (struct ringHeader*) ring;
+    while (chunk * slotSize < messageLength) {
+      // Wait for the client to fill the next slot, giving up if it goes away first
+      if (chunk == __atomic_load_n(&positions->produced, __ATOMIC_ACQUIRE)) {
+        if (waitForRing(establishedConnectionFD, ringFDs[1]) < 0)
+          break;
+        continue;
+      }
+
+      slot = ring + RING_HEADER_SIZE + (chunk % slotCount) * 2 * slotSize;
+      chunkLength = messageLength - chunk * slotSize < slotSize ? messageLength - chunk * slotSize : slotSize;
+      acquireSlot(workerArena);
+      encrypt(slot, chunkLength, slot + slotSize);
+      releaseSlot(workerArena);
+
+      chunk++;
+      __atomic_store_n(&positions->consumed, chunk, __ATOMIC_RELEASE);
+      write(ringFDs[2], &finished, sizeof(finished));
+    }
+    munmap(ring, ringSize);
+  }
+
+  // Count the request as failed if the ring couldn't be mapped or the client went away before the end
+  if (chunk * slotSize < messageLength)
+    recordError(workerArena);
+  for (int i = 0; i < RING_DESCRIPTOR_COUNT; i++)
+    close(ringFDs[i]);
+  finishRequest(workerArena, &startTime, chunk * slotSize < messageLength ? chunk * slotSize : messageLength);
+}
+
+/* Takes a connected socket and the worker's arena, then answers a "#Q" request with an accepted status line and the
+ * daemon's current metrics in the same text format the admin socket serves. The connection ends after the metrics,
+ * so the client reads until it's closed. */
+void handleStatsRequest(const int* establishedConnectionFD, struct arena* workerArena) {
+  size_t metricsLength = 0;
+  char* metrics = formatMetrics(workerArena->pool, &metricsLength);
+
+  sendStringToSocket(establishedConnectionFD, "+\n");
+  sendBytesToSocket(establishedConnectionFD, metrics, metricsLength);
+  free(metrics);
+}
+
+/* Takes a socket connected through the local socket, an array for file descriptors and how many are expected, then
+ * receives the single byte the descriptors are passed along with. Returns 0 if all of them arrived, or -1 if not. */
+int receiveDescriptors(const int* establishedConnectionFD, int descriptors[], int descriptorCount) {
+  char marker = '\0';
+  char control[CMSG_SPACE(RING_DESCRIPTOR_COUNT * sizeof(int))];
+  struct iovec markerVector = {&marker, 1};
+  struct msghdr message;
+  struct cmsghdr* controlMessage = NULL;
+
+  memset(&message, '\0', sizeof(message));
+  memset(control, '\0', sizeof(control));
+  message.msg_iov = &markerVector;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  if (recvmsg(*establishedConnectionFD, &message, 0) <= 0)
+    return(-1);
+
+  controlMessage = CMSG_FIRSTHDR(&message);
+  if (controlMessage == NULL || controlMessage->cmsg_level != SOL_SOCKET || controlMessage->cmsg_type != SCM_RIGHTS)
+    return(-1);
+  if (controlMessage->cmsg_len != CMSG_LEN(descriptorCount * sizeof(int))) {
+    // Don't keep hold of however many did arrive
+    for (size_t i = 0; i < (controlMessage->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++)
+      close(((int*) CMSG_DATA(controlMessage))[i]);
+    return(-1);
+  }
+
+  memcpy(descriptors, CMSG_DATA(controlMessage), descriptorCount * sizeof(int));
+  return(0);
+}
+
+/* Takes a socket and an event counter, then sleeps until the counter is added to, which is reset on waking. The
+ * socket is watched too, since nothing more is sent on it while a ring is in use, so anything arriving on it means
+ * the other side has gone away. Returns 0 once woken, or -1 if the other side has gone or stayed quiet for
+ * CONNECTION_TIMEOUT_S. */
+int waitForRing(const int* socketFD, int eventFD) {
+  struct pollfd watched[2];
+  unsigned long long count = 0;
+
+  watched[0].fd = eventFD;
+  watched[1].fd = *socketFD;
+  watched[0].events = watched[1].events = POLLIN;
+
+  switch (poll(watched, 2, CONNECTION_TIMEOUT_S * 1000)) {
+    case -1:
+      return(errno == EINTR ? 0 : -1);
+    case 0:
+      return(-1);
+  }
+  if (watched[1].revents & (POLLIN | POLLHUP | POLLERR))
+    return(-1);
+  if (watched[0].revents & POLLIN)
+    read(eventFD, &count, sizeof(count));
+
+  return(0);
+}
+
+/* Takes a connected socket, the worker's arena and a generate request's header line, which has "#G", the message
+ * length, the chunk size and optionally the name to keep the pad under in the pad store. Only the message follows,
+ * a chunk at a time, and each chunk's pad is generated as it's encrypted. Without a name, each chunk of ciphertext is
+ * sent back followed by the same length of pad. With one, the pad is written to the store and only the ciphertext is
+ * sent back. The status lines are the same as for stream requests. Returns 0 once the request is done, or -1 if the
+ * connection can't be used for another request. */
+int handleGenerateRequest(const int* establishedConnectionFD, struct arena* workerArena, const char header[]) {
+  unsigned long messageLength = 0, chunkSize = 0, chunkLength = 0, offset = 0;
+  char padName[HEADER_MAX_LENGTH], padPath[PATH_MAX];
+  int fields = 0, padFD = -1, failed = 0;
+  struct timespec startTime;
+
+  clock_gettime(CLOCK_MONOTONIC, &startTime);
+  padName[0] = '\0';
+  fields = sscanf(header, "#G %lu %lu %s", &messageLength, &chunkSize, padName);
+  if (fields < 2 || chunkSize < 1 || chunkSize > STREAM_MAX_CHUNK_SIZE || (fields == 3 && !isValidPadName(padName))) {
+    recordError(workerArena);
+    rejectRequest(establishedConnectionFD, "-The request header was not recognized.\n");
+    return(-1);
+  }
+  if (fields == 3 && padStoreDirectory == NULL) {
+    recordError(workerArena);
+    rejectRequest(establishedConnectionFD, "-The daemon has no pad store.\n");
+    return(-1);
+  }
+
+  // A chunk of message and the pad generated for it are held at a time, however long the message is
+  if (reserveArena(workerArena, 2 * chunkSize + 1) < 0) {
+    rejectRequest(establishedConnectionFD, "-The request would exceed the daemon's memory budget.\n");
+    return(-1);
+  }
+
+  if (admitRequest(workerArena, classifyRequest(workerArena->pool, messageLength), 1) < 0) {
+    rejectRequest(establishedConnectionFD, "~The daemon is busy with bulk requests.\n");
+    return(-1);
+  }
+
+  // A pad must never be used twice, so an existing pad is never replaced
+  if (fields == 3) {
+    snprintf(padPath, sizeof(padPath), "%s/%s", padStoreDirectory, padName);
+    padFD = open(padPath, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (padFD < 0) {
+      recordError(workerArena);
+      finishRequest(workerArena, &startTime, 0);
+      rejectRequest(establishedConnectionFD, errno == EEXIST ? "-A pad with that name is already in the store.\n" :
+                                                               "-The pad couldn't be added to the store.\n");
+      return(-1);
+    }
+  }
+  failed = sendStringToSocket(establishedConnectionFD, "+\n") < 0;
+
+  for (offset = 0; offset < messageLength && !failed; offset += chunkLength) {
+    chunkLength = messageLength - offset < chunkSize ? messageLength - offset : chunkSize;
+    if (receiveExactly(establishedConnectionFD, workerArena->base, chunkLength) < 0) {
+      failed = 1;
       break;
+    }
+
+    acquireSlot(workerArena);
+    failed = generateAndEncrypt(workerArena->base, chunkLength, workerArena->base + chunkLength) < 0;
+    releaseSlot(workerArena);
 
-    strcat(message, messageFragment);
+    // The pad follows its ciphertext in the arena, so both go back in one send when the client keeps the pad
+    if (!failed && padFD >= 0) {
+      failed = writeToPadStore(padFD, workerArena->base + chunkLength, chunkLength) < 0 ||
+               sendBytesToSocket(establishedConnectionFD, workerArena->base, chunkLength) < 0;
+    } else if (!failed) {
+      failed = sendBytesToSocket(establishedConnectionFD, workerArena->base, 2 * chunkLength) < 0;
+    }
+  }
+
+  // Stored pads end with a newline like keygen's, and a pad for a message that never finished is of no use to anyone
+  if (padFD >= 0) {
+    if (!failed)
+      failed = writeToPadStore(padFD, "\n", 1) < 0;
+    close(padFD);
+    if (failed)
+      unlink(padPath);
   }
 
-  /* Find the terminal location using the method in the Network Clients video from Block 4
-   * then set a null terminator after the actual message contents end. */
-  terminalLocation = strstr(message, endOfMessage) - message;
-  message[terminalLocation] = '\0';
+  if (failed)
+    recordError(workerArena);
+  finishRequest(workerArena, &startTime, offset);
+  return(failed ? -1 : 0);
 }
 
-/* Takes a pointer to a socket, followed by a string to send via that socket,
- * then loops to ensure all the data in the string is sent. */
-void sendStringToSocket(const int* socketFD, const char message[]) {
-  int charsWritten;
-  // Send message to server
-  charsWritten = send(*socketFD, message, strlen(message), 0); // Write to the server
-  if (charsWritten < 0)
-    error("An error occurred writing to the socket");
-
-  while (charsWritten < strlen(message)) {
-    int addedChars = 0;
-    // Write to the server again, starting from one character after the most recently sent character
-    addedChars = send(*socketFD, message + charsWritten, strlen(message) - charsWritten, 0);
-    if (addedChars < 0)
-      error("An error occurred writing to the socket");
+/* Takes a message, its length and a buffer for its pad, then fills the pad with characters drawn from the kernel's
+ * CSPRNG and encrypts the message with it in the same pass. Random bytes of 243 and up are thrown away, so every one
+ * of the 27 pad characters is equally likely. Returns 0, or -1 if no random bytes could be had. */
+int generateAndEncrypt(char message[], const unsigned long messageLength, char pad[]) {
+  unsigned char randomBytes[RANDOM_BATCH_SIZE];
+  ssize_t available = 0, used = 0;
+  int plaintextValue = -1, padValue = -1, encryptedValue = -1;
+
+  for (size_t i = 0; i < messageLength; i++) {
+    padValue = -1;
+    while (padValue < 0 || padValue >= 243) {
+      // Take another batch of random bytes when this one has been used up
+      if (used == available) {
+        available = getrandom(randomBytes, sizeof(randomBytes), 0);
+        if (available < 0 && errno == EINTR)
+          available = 0;
+        if (available < 0)
+          return(-1);
+        used = 0;
+        continue;
+      }
+      padValue = randomBytes[used++];
+    }
+    padValue %= 27;
+
+    if ((int) message[i] == 32)
+      plaintextValue = 26;
+    else
+      plaintextValue = (int) (message[i] - 65);
+
+    encryptedValue = (plaintextValue + padValue) % 27;
+
+    pad[i] = padValue == 26 ? (char) 32 : (char) (padValue + 65);
+    message[i] = encryptedValue == 26 ? (char) 32 : (char) (encryptedValue + 65);
+  }
+
+  return(0);
+}
+
+// Takes a pad name from a request, then returns whether it's safe to use as a file name in the pad store
+int isValidPadName(const char padName[]) {
+  size_t length = strlen(padName);
+
+  if (length == 0 || length > PAD_NAME_MAX_LENGTH || padName[0] == '.')
+    return(0);
+  for (size_t i = 0; i < length; i++) {
+    if (!isalnum((unsigned char) padName[i]) && padName[i] != '-' && padName[i] != '_' && padName[i] != '.')
+      return(0);
+  }
+  return(1);
+}
+
+/* Takes a file in the pad store, a buffer and its length, then loops until the whole buffer has been written.
+ * Returns 0 on success, or -1 if the write failed. */
+int writeToPadStore(int padFD, const char buffer[], size_t length) {
+  size_t written = 0;
+  ssize_t charsWritten = -5;
+
+  while (written < length) {
+    charsWritten = write(padFD, buffer + written, length - written);
+    if (charsWritten < 0 && errno == EINTR)
+      continue;
+    if (charsWritten <= 0)
+      return(-1);
+    written += charsWritten;
+  }
+
+  return(0);
+}
+
+/* Takes a connected socket and a status line turning down a request, then sends the status line and stops sending.
+ * Anything the client already sent is read and thrown away until it closes the connection, because closing with
+ * unread data would reset the connection and could lose the status line before the client reads it. */
+void rejectRequest(const int* establishedConnectionFD, const char status[]) {
+  char discard[4096];
+
+  sendStringToSocket(establishedConnectionFD, status);
+  shutdown(*establishedConnectionFD, SHUT_WR);
+  while (recv(*establishedConnectionFD, discard, sizeof(discard), 0) > 0);
+}
+
+// Takes the shared pool state and the declared length of a message, then returns the lane the request belongs in
+int classifyRequest(const struct poolState* pool, unsigned long messageLength) {
+  return(messageLength <= pool->smallLimit ? LANE_SMALL : LANE_BULK);
+}
+
+/* Takes a worker's arena, the lane its new request belongs in and whether the request can be turned away, then adds
+ * the request to the lane. Bulk requests that can be turned away can't take the workers held back for small requests,
+ * and neither can bulk connections waiting for their next request, since those workers aren't free either.
+ * Returns 0 if the request was admitted, or -1 if not. */
+int admitRequest(struct arena* workerArena, int lane, int mayReject) {
+  struct poolState* pool = workerArena->pool;
+  int admitted = 0;
+
+  lockScheduler(pool);
+  if (lane == LANE_SMALL || !mayReject ||
+      pool->lanes[LANE_BULK].active + pool->lanes[LANE_BULK].idle <
+        (unsigned long) (pool->workerCount - pool->reservedWorkers)) {
+    pool->lanes[lane].active++;
+    pool->lanes[lane].requests++;
+    workerArena->stats->lane = lane;
+    workerArena->lastLane = lane;
+    admitted = 1;
+  } else {
+    pool->lanes[lane].rejected++;
+  }
+  unlockScheduler(pool);
 
-    // Exit the loop if no more characters are being sent to the server.
-    if (addedChars == 0) {
+  // Only this worker writes its own counters, so they don't need the lock
+  if (admitted)
+    __atomic_store_n(&workerArena->stats->requests, workerArena->stats->requests + 1, __ATOMIC_RELAXED);
+  return(admitted ? 0 : -1);
+}
+
+/* Takes a worker's arena, the time its request started and the number of message bytes it transformed, then removes
+ * the request from its lane and records its latency. The worker's own counters and latency histogram are only ever
+ * written by the worker, so they're updated with plain atomic stores instead of under the scheduler lock. */
+void finishRequest(struct arena* workerArena, const struct timespec* startTime, unsigned long long bytes) {
+  struct poolState* pool = workerArena->pool;
+  struct workerStats* stats = workerArena->stats;
+  struct timespec endTime;
+  unsigned long long latency = 0;
+  int lane = workerArena->stats->lane, bucket = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &endTime);
+  latency = (endTime.tv_sec - startTime->tv_sec) * 1000000ULL + (endTime.tv_nsec - startTime->tv_nsec) / 1000;
+
+  // The last bucket counts every latency over the largest bound
+  while (bucket < LATENCY_BUCKET_COUNT && latency > (unsigned long long) LATENCY_BUCKET_BASE_US << bucket)
+    bucket++;
+  __atomic_store_n(&stats->latencyBuckets[bucket], stats->latencyBuckets[bucket] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->latencyTotal, stats->latencyTotal + latency, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->bytes, stats->bytes + bytes, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->completed, stats->completed + 1, __ATOMIC_RELEASE);
+
+  lockScheduler(pool);
+  pool->lanes[lane].active--;
+  pool->lanes[lane].completed++;
+  pool->lanes[lane].latencyTotal += latency;
+  pool->lanes[lane].latencyBuckets[bucket]++;
+  if (latency > pool->lanes[lane].latencyMax)
+    pool->lanes[lane].latencyMax = latency;
+  workerArena->stats->lane = -1;
+  unlockScheduler(pool);
+}
+
+// Takes a worker's arena, then counts a request that failed or was malformed against the worker
+void recordError(struct arena* workerArena) {
+  __atomic_store_n(&workerArena->stats->errors, workerArena->stats->errors + 1, __ATOMIC_RELAXED);
+}
+
+/* Takes a worker's arena, then waits until the worker's lane is allowed a CPU slot for its next chunk. A lane may
+ * take a slot when one is free and no other lane with chunks waiting has had less weighted service (its pass). Each
+ * slot taken adds to the lane's pass in inverse proportion to its weight, so busy lanes share the slots by weight.
+ * A lane that was idle starts level with the busy lane instead of using up the service it missed all at once. */
+void acquireSlot(struct arena* workerArena) {
+  struct poolState* pool = workerArena->pool;
+  int lane = workerArena->stats->lane, sequence = 0, mayRun = 0;
+
+  lockScheduler(pool);
+  for (int other = 0; other < LANE_COUNT; other++) {
+    if (other != lane && pool->lanes[lane].waiting + pool->lanes[lane].running == 0 &&
+        pool->lanes[other].waiting + pool->lanes[other].running > 0 && pool->lanes[other].pass > pool->lanes[lane].pass)
+      pool->lanes[lane].pass = pool->lanes[other].pass;
+  }
+  pool->lanes[lane].waiting++;
+
+  while (1) {
+    mayRun = pool->slotsFree > 0;
+    for (int other = 0; other < LANE_COUNT && mayRun; other++) {
+      if (other != lane && pool->lanes[other].waiting > 0 && (pool->lanes[other].pass < pool->lanes[lane].pass ||
+          (pool->lanes[other].pass == pool->lanes[lane].pass && other < lane)))
+        mayRun = 0;
+    }
+    if (mayRun)
       break;
+
+    // Sleep until a slot is released, which always changes the sequence number
+    sequence = pool->schedulerSequence;
+    unlockScheduler(pool);
+    syscall(SYS_futex, &pool->schedulerSequence, FUTEX_WAIT, sequence, NULL, NULL, 0);
+    lockScheduler(pool);
+  }
+
+  pool->slotsFree--;
+  pool->lanes[lane].waiting--;
+  pool->lanes[lane].running++;
+  pool->lanes[lane].pass += LANE_STRIDE / laneWeights[lane];
+  workerArena->stats->holdingSlot = 1;
+  unlockScheduler(pool);
+}
+
+// Takes a worker's arena, then gives its CPU slot back and wakes any workers waiting for one
+void releaseSlot(struct arena* workerArena) {
+  struct poolState* pool = workerArena->pool;
+
+  lockScheduler(pool);
+  pool->slotsFree++;
+  pool->lanes[workerArena->stats->lane].running--;
+  pool->schedulerSequence++;
+  workerArena->stats->holdingSlot = 0;
+  unlockScheduler(pool);
+  syscall(SYS_futex, &pool->schedulerSequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Takes the shared pool state and spins until its scheduler lock is taken, which is only ever held briefly
+void lockScheduler(struct poolState* pool) {
+  while (__atomic_exchange_n(&pool->schedulerLock, 1, __ATOMIC_ACQUIRE))
+    sched_yield();
+}
+
+// Takes the shared pool state and releases its scheduler lock
+void unlockScheduler(struct poolState* pool) {
+  __atomic_store_n(&pool->schedulerLock, 0, __ATOMIC_RELEASE);
+}
+
+/* Takes a worker's arena and the number of bytes a request needs, then grows the arena if it's smaller than that.
+ * Growth is admitted against the pool's memory budget first, and the arena's used bytes are carried over to the
+ * new mapping. Returns 0 when the arena is large enough, or -1 if growing it would exceed the budget. */
+int reserveArena(struct arena* workerArena, size_t required) {
+  size_t granule = arenaGranule(workerArena->pool);
+  size_t newCapacity = workerArena->capacity * 2;
+  size_t growth = 0, reserved = 0;
+  char* newBase = NULL;
+
+  if (required <= workerArena->capacity)
+    return(0);
+
+  // Double the arena (or more when needed) so a request that arrives in pieces only grows it a few times
+  if (newCapacity < required)
+    newCapacity = required;
+  newCapacity = (newCapacity + granule - 1) / granule * granule;
+  growth = newCapacity - workerArena->capacity;
+
+  // Claim the growth from the budget, failing if another worker claimed what was left first
+  reserved = __atomic_load_n(&workerArena->pool->memoryReserved, __ATOMIC_SEQ_CST);
+  do {
+    if (reserved + growth > workerArena->pool->memoryBudget) {
+      __atomic_store_n(&workerArena->stats->rejected, workerArena->stats->rejected + 1, __ATOMIC_RELAXED);
+      return(-1);
+    }
+  } while (!__atomic_compare_exchange_n(&workerArena->pool->memoryReserved, &reserved, reserved + growth, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+  newBase = mapArenaRegion(newCapacity, workerArena->pool->hugePages);
+  if (newBase == NULL) {
+    __atomic_fetch_sub(&workerArena->pool->memoryReserved, growth, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&workerArena->stats->rejected, workerArena->stats->rejected + 1, __ATOMIC_RELAXED);
+    return(-1);
+  }
+
+  if (workerArena->base != NULL) {
+    memcpy(newBase, workerArena->base, workerArena->used);
+    munmap(workerArena->base, workerArena->capacity);
+  }
+
+  workerArena->base = newBase;
+  workerArena->capacity = newCapacity;
+  workerArena->stats->resident = newCapacity;
+  if (newCapacity > workerArena->stats->peak)
+    workerArena->stats->peak = newCapacity;
+
+  return(0);
+}
+
+/* Takes a worker's arena and shrinks it back to the size it started with if a large request grew it, returning the
+ * difference to the pool's memory budget so every worker's resident size stays steady between requests. */
+void trimArena(struct arena* workerArena) {
+  size_t granule = arenaGranule(workerArena->pool);
+  size_t retainSize = (ARENA_RETAIN_SIZE + granule - 1) / granule * granule;
+  char* newBase = NULL;
+
+  if (workerArena->capacity <= retainSize)
+    return;
+
+  newBase = mapArenaRegion(retainSize, workerArena->pool->hugePages);
+  if (newBase == NULL)
+    return;
+
+  munmap(workerArena->base, workerArena->capacity);
+  __atomic_fetch_sub(&workerArena->pool->memoryReserved, workerArena->capacity - retainSize, __ATOMIC_SEQ_CST);
+  workerArena->base = newBase;
+  workerArena->capacity = retainSize;
+  workerArena->used = 0;
+  workerArena->stats->resident = retainSize;
+}
+
+/* Takes a size and whether huge pages were requested, then maps a private region of that size, falling back to
+ * regular pages if no huge pages are available. Returns NULL if the region couldn't be mapped at all. */
+char* mapArenaRegion(size_t size, int hugePages) {
+  char* region = MAP_FAILED;
+
+  if (hugePages)
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (region == MAP_FAILED)
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  return(region == MAP_FAILED ? NULL : region);
+}
+
+// Returns the size arenas are rounded up to, which has to be a whole number of huge pages when they're in use
+size_t arenaGranule(const struct poolState* pool) {
+  return(pool->hugePages ? HUGE_PAGE_GRANULE : ARENA_GRANULE);
+}
+
+/* Takes a socket, the worker's arena and a small string used by client and server to indicate the end of a message.
+ * Reads from the socket straight into the arena, growing it as needed, until the substring is found. The substring
+ * that marks the end of the message is then replaced with a null terminator. Only the newly read bytes (and the few
+ * before them the substring could start in) are searched, so long messages aren't scanned over and over. Returns the
+ * length of the message, -1 if the connection ended first, or -2 if the message would exceed the memory budget. */
+long receiveIntoArena(const int* establishedConnectionFD, struct arena* workerArena, const char endOfMessage[]) {
+  size_t terminatorLength = strlen(endOfMessage), searchFrom = 0;
+  ssize_t charsRead = -5;
+  char* terminalLocation = NULL;
+
+  workerArena->used = 0;
+  while (terminalLocation == NULL) {
+    // Always leave room for the null terminator after the bytes we've read
+    if (workerArena->used + 1 >= workerArena->capacity &&
+        reserveArena(workerArena, workerArena->capacity + 1) < 0)
+      return(-2);
+
+    charsRead = recv(*establishedConnectionFD, workerArena->base + workerArena->used,
+                     workerArena->capacity - workerArena->used - 1, 0);
+
+    // Stop if we either don't read any more characters when receiving, or we failed to retrieve any characters
+    if (charsRead <= 0)
+      return(-1);
+
+    searchFrom = workerArena->used >= terminatorLength ? workerArena->used - terminatorLength + 1 : 0;
+    workerArena->used += charsRead;
+    workerArena->base[workerArena->used] = '\0';
+    terminalLocation = strstr(workerArena->base + searchFrom, endOfMessage);
+  }
+
+  *terminalLocation = '\0';
+  return(terminalLocation - workerArena->base);
+}
+
+/* Takes a socket, a buffer and the buffer's size, then reads a single newline terminated line into the buffer without
+ * reading anything after it. Whatever has arrived is peeked at first so the line can usually be read with one more
+ * call. The newline is replaced with a null terminator. Returns 0 on success, or -1 if the connection ended or the
+ * line didn't fit in the buffer. */
+int receiveHeaderLine(const int* establishedConnectionFD, char line[], size_t lineSize) {
+  size_t lineLength = 0;
+  ssize_t charsRead = -5;
+  char* newline = NULL;
+
+  while (lineLength < lineSize - 1) {
+    charsRead = recv(*establishedConnectionFD, line + lineLength, lineSize - 1 - lineLength, MSG_PEEK);
+    if (charsRead <= 0)
+      return(-1);
+
+    // Only take the characters up to and including the newline, if it has arrived
+    newline = memchr(line + lineLength, '\n', charsRead);
+    if (newline != NULL)
+      charsRead = newline - (line + lineLength) + 1;
+
+    charsRead = recv(*establishedConnectionFD, line + lineLength, charsRead, 0);
+    if (charsRead <= 0)
+      return(-1);
+    lineLength += charsRead;
+
+    if (newline != NULL) {
+      line[lineLength - 1] = '\0';
+      return(0);
+    }
+  }
+
+  return(-1);
+}
+
+/* Takes a socket, a buffer and a number of bytes, then reads exactly that many bytes into the buffer.
+ * Returns 0 on success, or -1 if the connection ended first. */
+int receiveExactly(const int* establishedConnectionFD, char buffer[], size_t length) {
+  size_t totalRead = 0;
+  ssize_t charsRead = -5;
+
+  while (totalRead < length) {
+    charsRead = recv(*establishedConnectionFD, buffer + totalRead, length - totalRead, MSG_WAITALL);
+    if (charsRead <= 0)
+      return(-1);
+    totalRead += charsRead;
+  }
+
+  return(0);
+}
+
+/* Returns whether the worker has been told to drain. The signal is blocked except while the worker waits, so it's
+ * looked for among the pending signals too, in case it arrived while the worker was busy. */
+int isDraining(void) {
+  sigset_t pendingSignals;
+
+  if (!drainRequested && sigpending(&pendingSignals) == 0 && sigismember(&pendingSignals, SIGUSR2))
+    drainRequested = 1;
+  return(drainRequested);
+}
+
+/* Takes a connected socket and the worker's arena, then waits for the client to send its next request or close the
+ * connection, whichever comes first. While it waits, the connection counts against the lane of the request it last
+ * sent, so idle keep-alive connections can't leave the small lane without the workers held back for it. Returns 0
+ * once either has happened, -1 if the worker was told to drain first, or -2 if nothing arrived for
+ * CONNECTION_TIMEOUT_S. */
+int waitForNextRequest(const int* establishedConnectionFD, struct arena* workerArena) {
+  struct poolState* pool = workerArena->pool;
+  struct pollfd connection;
+  struct timespec timeout = {CONNECTION_TIMEOUT_S, 0};
+  int result = -1;
+
+  connection.fd = *establishedConnectionFD;
+  connection.events = POLLIN;
+
+  lockScheduler(pool);
+  pool->lanes[workerArena->lastLane].idle++;
+  workerArena->stats->idleLane = workerArena->lastLane;
+  unlockScheduler(pool);
+
+  while (result == -1 && !isDraining()) {
+    switch (ppoll(&connection, 1, &timeout, &drainWaitMask)) {
+      case -1:
+        if (errno != EINTR)
+          result = 0;
+        break;
+      case 0:
+        result = -2;
+        break;
+      default:
+        result = 0;
+    }
+  }
+
+  lockScheduler(pool);
+  pool->lanes[workerArena->lastLane].idle--;
+  workerArena->stats->idleLane = -1;
+  unlockScheduler(pool);
+
+  return(result);
+}
+
+// Takes the shared pool state and prints each worker's request count and memory use, followed by the pool's totals
+void printPoolStats(const struct poolState* pool) {
+  for (int i = 0; i < pool->workerCount; i++) {
+    fprintf(stderr, "worker %d (pid %d): %lu requests, %lu rejected, %lu errors, %llu bytes processed, "
+            "%zu bytes resident, %zu bytes peak\n", i, (int) pool->workers[i].pid, pool->workers[i].requests,
+            pool->workers[i].rejected, pool->workers[i].errors, pool->workers[i].bytes, pool->workers[i].resident,
+            pool->workers[i].peak);
+  }
+  for (int lane = 0; lane < LANE_COUNT; lane++) {
+    fprintf(stderr, "lane %s: %lu requests, %lu rejected, %lu active, %lu idle, %lu chunks queued, %llu us average "
+            "latency, %llu us max latency\n", laneNames[lane], pool->lanes[lane].requests, pool->lanes[lane].rejected,
+            pool->lanes[lane].active, pool->lanes[lane].idle, pool->lanes[lane].waiting,
+            pool->lanes[lane].completed > 0 ? pool->lanes[lane].latencyTotal / pool->lanes[lane].completed : 0,
+            pool->lanes[lane].latencyMax);
+  }
+  fprintf(stderr, "pool: %zu of %zu bytes reserved\n", pool->memoryReserved, pool->memoryBudget);
+}
+
+/* Takes the shared pool state and a pointer for the length of the result, then formats the daemon's metrics in
+ * Prometheus' text format into a newly allocated buffer: counters and gauges for each worker and lane, the memory
+ * budget, a latency histogram for each lane and one summed over every worker. Every value is read with an atomic
+ * load, without taking any locks, so reading the metrics never holds up a worker. Returns the buffer, which the
+ * caller frees. */
+char* formatMetrics(const struct poolState* pool, size_t* metricsLength) {
+  const struct workerStats* stats = NULL;
+  char* metrics = NULL;
+  size_t metricsSize = 0;
+  unsigned long buckets[LATENCY_BUCKET_COUNT + 1], cumulative = 0, busyWorkers = 0, completed = 0;
+  unsigned long long latencyTotal = 0;
+
+  memset(buckets, '\0', sizeof(buckets));
+  *metricsLength = 0;
+
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "requests_total Requests admitted.\n"
+               "# TYPE " METRIC_PREFIX "requests_total counter\n");
+  for (int i = 0; i < pool->workerCount; i++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "requests_total{worker=\"%d\"} %lu\n", i,
+                 __atomic_load_n(&pool->workers[i].requests, __ATOMIC_RELAXED));
+
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "errors_total Requests that were "
+               "malformed or failed part way.\n# TYPE " METRIC_PREFIX "errors_total counter\n");
+  for (int i = 0; i < pool->workerCount; i++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "errors_total{worker=\"%d\"} %lu\n", i,
+                 __atomic_load_n(&pool->workers[i].errors, __ATOMIC_RELAXED));
+
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "budget_rejections_total Requests "
+               "turned away by the memory budget.\n# TYPE " METRIC_PREFIX "budget_rejections_total counter\n");
+  for (int i = 0; i < pool->workerCount; i++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "budget_rejections_total{worker=\"%d\"} %lu\n",
+                 i, __atomic_load_n(&pool->workers[i].rejected, __ATOMIC_RELAXED));
+
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "processed_bytes_total Message bytes "
+               "transformed.\n# TYPE " METRIC_PREFIX "processed_bytes_total counter\n");
+  for (int i = 0; i < pool->workerCount; i++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "processed_bytes_total{worker=\"%d\"} %llu\n",
+                 i, __atomic_load_n(&pool->workers[i].bytes, __ATOMIC_RELAXED));
+
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "resident_bytes Bytes reserved for "
+               "the worker's arena.\n# TYPE " METRIC_PREFIX "resident_bytes gauge\n");
+  for (int i = 0; i < pool->workerCount; i++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "resident_bytes{worker=\"%d\"} %zu\n", i,
+                 __atomic_load_n(&pool->workers[i].resident, __ATOMIC_RELAXED));
+
+  // A worker is busy while it has a request in a lane
+  for (int i = 0; i < pool->workerCount; i++) {
+    if (__atomic_load_n(&pool->workers[i].lane, __ATOMIC_RELAXED) >= 0)
+      busyWorkers++;
+  }
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "workers Worker processes.\n"
+               "# TYPE " METRIC_PREFIX "workers gauge\n" METRIC_PREFIX "workers %d\n"
+               "# HELP " METRIC_PREFIX "busy_workers Workers handling a request.\n"
+               "# TYPE " METRIC_PREFIX "busy_workers gauge\n" METRIC_PREFIX "busy_workers %lu\n",
+               pool->workerCount, busyWorkers);
+
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "lane_active_requests Requests being "
+               "handled in each lane.\n# TYPE " METRIC_PREFIX "lane_active_requests gauge\n");
+  for (int lane = 0; lane < LANE_COUNT; lane++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "lane_active_requests{lane=\"%s\"} %lu\n",
+                 laneNames[lane], __atomic_load_n(&pool->lanes[lane].active, __ATOMIC_RELAXED));
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "lane_busy_rejections_total Requests "
+               "turned away to keep workers free for small requests.\n"
+               "# TYPE " METRIC_PREFIX "lane_busy_rejections_total counter\n");
+  for (int lane = 0; lane < LANE_COUNT; lane++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "lane_busy_rejections_total{lane=\"%s\"} %lu\n",
+                 laneNames[lane], __atomic_load_n(&pool->lanes[lane].rejected, __ATOMIC_RELAXED));
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "lane_queued_chunks Chunks waiting "
+               "for a CPU slot in each lane.\n# TYPE " METRIC_PREFIX "lane_queued_chunks gauge\n");
+  for (int lane = 0; lane < LANE_COUNT; lane++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "lane_queued_chunks{lane=\"%s\"} %lu\n",
+                 laneNames[lane], __atomic_load_n(&pool->lanes[lane].waiting, __ATOMIC_RELAXED));
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "lane_requests_total Requests "
+               "admitted to each lane.\n# TYPE " METRIC_PREFIX "lane_requests_total counter\n");
+  for (int lane = 0; lane < LANE_COUNT; lane++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "lane_requests_total{lane=\"%s\"} %lu\n",
+                 laneNames[lane], __atomic_load_n(&pool->lanes[lane].requests, __ATOMIC_RELAXED));
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "lane_completed_requests_total "
+               "Requests finished in each lane.\n# TYPE " METRIC_PREFIX "lane_completed_requests_total counter\n");
+  for (int lane = 0; lane < LANE_COUNT; lane++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "lane_completed_requests_total{lane=\"%s\"} "
+                 "%lu\n", laneNames[lane], __atomic_load_n(&pool->lanes[lane].completed, __ATOMIC_RELAXED));
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "lane_idle_connections Connections "
+               "holding a worker between requests, by the lane of their last request.\n"
+               "# TYPE " METRIC_PREFIX "lane_idle_connections gauge\n");
+  for (int lane = 0; lane < LANE_COUNT; lane++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "lane_idle_connections{lane=\"%s\"} %lu\n",
+                 laneNames[lane], __atomic_load_n(&pool->lanes[lane].idle, __ATOMIC_RELAXED));
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "lane_request_duration_max_seconds "
+               "The longest request in each lane since the daemon started.\n"
+               "# TYPE " METRIC_PREFIX "lane_request_duration_max_seconds gauge\n");
+  for (int lane = 0; lane < LANE_COUNT; lane++)
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "lane_request_duration_max_seconds"
+                 "{lane=\"%s\"} %.6f\n", laneNames[lane],
+                 (double) __atomic_load_n(&pool->lanes[lane].latencyMax, __ATOMIC_RELAXED) / 1000000);
+
+  // Each lane gets its own histogram so the small lane's tail latency isn't hidden behind bulk requests
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "lane_request_duration_seconds Time "
+               "from a request's header to its last byte in each lane.\n"
+               "# TYPE " METRIC_PREFIX "lane_request_duration_seconds histogram\n");
+  for (int lane = 0; lane < LANE_COUNT; lane++) {
+    cumulative = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKET_COUNT; bucket++) {
+      cumulative += __atomic_load_n(&pool->lanes[lane].latencyBuckets[bucket], __ATOMIC_RELAXED);
+      appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "lane_request_duration_seconds_bucket"
+                   "{lane=\"%s\",le=\"%g\"} %lu\n", laneNames[lane],
+                   (double) (LATENCY_BUCKET_BASE_US << bucket) / 1000000, cumulative);
     }
+    cumulative += __atomic_load_n(&pool->lanes[lane].latencyBuckets[LATENCY_BUCKET_COUNT], __ATOMIC_RELAXED);
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "lane_request_duration_seconds_bucket"
+                 "{lane=\"%s\",le=\"+Inf\"} %lu\n" METRIC_PREFIX "lane_request_duration_seconds_sum{lane=\"%s\"} "
+                 "%.6f\n" METRIC_PREFIX "lane_request_duration_seconds_count{lane=\"%s\"} %lu\n", laneNames[lane],
+                 cumulative, laneNames[lane],
+                 (double) __atomic_load_n(&pool->lanes[lane].latencyTotal, __ATOMIC_RELAXED) / 1000000,
+                 laneNames[lane], cumulative);
+  }
+  cumulative = 0;
+
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "memory_reserved_bytes Bytes of the "
+               "memory budget in use.\n# TYPE " METRIC_PREFIX "memory_reserved_bytes gauge\n"
+               METRIC_PREFIX "memory_reserved_bytes %zu\n# HELP " METRIC_PREFIX "memory_budget_bytes The memory "
+               "budget.\n# TYPE " METRIC_PREFIX "memory_budget_bytes gauge\n" METRIC_PREFIX "memory_budget_bytes %zu\n",
+               __atomic_load_n(&pool->memoryReserved, __ATOMIC_RELAXED), pool->memoryBudget);
+
+  // Prometheus histograms count every observation at or below each bound, so the buckets are added up as they go
+  for (int i = 0; i < pool->workerCount; i++) {
+    stats = &pool->workers[i];
+    completed += __atomic_load_n(&stats->completed, __ATOMIC_ACQUIRE);
+    latencyTotal += __atomic_load_n(&stats->latencyTotal, __ATOMIC_RELAXED);
+    for (int bucket = 0; bucket <= LATENCY_BUCKET_COUNT; bucket++)
+      buckets[bucket] += __atomic_load_n(&stats->latencyBuckets[bucket], __ATOMIC_RELAXED);
+  }
+  appendMetric(&metrics, &metricsSize, metricsLength, "# HELP " METRIC_PREFIX "request_duration_seconds Time from "
+               "a request's header to its last byte.\n# TYPE " METRIC_PREFIX "request_duration_seconds histogram\n");
+  for (int bucket = 0; bucket < LATENCY_BUCKET_COUNT; bucket++) {
+    cumulative += buckets[bucket];
+    appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "request_duration_seconds_bucket{le=\"%g\"} "
+                 "%lu\n", (double) (LATENCY_BUCKET_BASE_US << bucket) / 1000000, cumulative);
+  }
+  cumulative += buckets[LATENCY_BUCKET_COUNT];
+  appendMetric(&metrics, &metricsSize, metricsLength, METRIC_PREFIX "request_duration_seconds_bucket{le=\"+Inf\"} "
+               "%lu\n" METRIC_PREFIX "request_duration_seconds_sum %.6f\n" METRIC_PREFIX
+               "request_duration_seconds_count %lu\n", cumulative, (double) latencyTotal / 1000000, cumulative);
+
+  return(metrics);
+}
+
+/* Takes a pointer to a growing buffer, its size and the length of its contents, then appends the formatted text,
+ * doubling the buffer whenever it doesn't fit. */
+void appendMetric(char** buffer, size_t* bufferSize, size_t* bufferLength, const char* format, ...) {
+  va_list arguments;
+  int written = 0;
+
+  while (1) {
+    va_start(arguments, format);
+    written = vsnprintf(*buffer + *bufferLength, *bufferSize - *bufferLength, format, arguments);
+    va_end(arguments);
+
+    if (written >= 0 && *bufferLength + written < *bufferSize)
+      break;
+
+    *bufferSize = *bufferSize > 0 ? *bufferSize * 2 : 4096;
+    *buffer = realloc(*buffer, *bufferSize);
+    if (*buffer == NULL)
+      error("An error occurred allocating memory for the metrics");
+  }
+
+  *bufferLength += written;
+}
+
+/* Takes a pointer to a socket, followed by a buffer and the number of bytes to send from it,
+ * then loops to ensure all the data in the buffer is sent. Returns 0 if it was, or -1 if the client went away first,
+ * which only ends that connection rather than the worker. */
+int sendBytesToSocket(const int* socketFD, const char message[], size_t messageLength) {
+  size_t charsWritten = 0;
+
+  while (charsWritten < messageLength) {
+    int addedChars = 0;
+    // Write to the client, starting from one character after the most recently sent character
+    addedChars = send(*socketFD, message + charsWritten, messageLength - charsWritten, 0);
+    if (addedChars < 0 && errno == EINTR)
+      continue;
+
+    // Give up if no more characters are being sent to the client.
+    if (addedChars <= 0)
+      return(-1);
 
     // Add the number of characters written in an iteration to the total number of characters sent in the message
     charsWritten += addedChars;
   }
+
+  return(0);
+}
+
+/* Takes a pointer to a socket, followed by a string to send via that socket,
+ * then loops to ensure all the data in the string is sent. Returns 0 if it was, or -1 if not. */
+int sendStringToSocket(const int* socketFD, const char message[]) {
+  return(sendBytesToSocket(socketFD, message, strlen(message)));
 }